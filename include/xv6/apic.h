@@ -10,6 +10,7 @@ struct ioapic {
 
 // ioapic.c
 void ioapicenable(int irq, int cpu);
+void ioapicroute(int irq, int vector, int cpu);
 extern volatile struct ioapic *ioapic;
 void ioapicinit(void);
 
@@ -3,12 +3,22 @@
 #include <xv6/sleeplock.h>
 #include <xv6/types.h>
 
-#define BSIZE 512 // block size
+#define BSIZE 4096 // block size; mkfs records it in the superblock
 
+struct buf;
+
+void bdump(void);
 void binit(void);
+void biodone(struct buf *b);
+void breada(uint dev, uint blockno);
 struct buf *bread(uint dev, uint blockno);
+struct buf *bnew(uint dev, uint blockno);
 void brelse(struct buf *b);
+int bshrink(void);
+void bsubmit(struct buf *b);
+void bwait(struct buf *b);
 void bwrite(struct buf *b);
+void bwriteasync(struct buf *b);
 
 struct buf {
   int flags;
@@ -16,11 +26,14 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  int used;          // referenced since the clock hand last passed
+  struct buf *hnext; // hash bucket chain
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data; // BSIZE bytes, in a page shared with neighbouring bufs,
+               // or the block itself if the disk is in memory (idemap)
 };
 
-#define B_VALID 0x2 // buffer has been read from disk
-#define B_DIRTY 0x4 // buffer needs to be written to disk
+#define B_VALID 0x2  // buffer has been read from disk
+#define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // release the buffer when the transfer completes
+#define B_BUSY  0x10 // transfer in progress
@@ -5,6 +5,13 @@
 #include <xv6/stat.h>
 #include <xv6/types.h>
 
+// Sequential access detection for readahead, per open file.
+struct readahead {
+  uint next; // block after the last one read
+  uint win;  // readahead window in blocks; 0 while access looks random
+  uint end;  // first block not yet submitted for readahead
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
   int ref; // reference count
@@ -13,6 +20,7 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  struct readahead ra;
 };
 
 // table mapping major device number to
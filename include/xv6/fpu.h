@@ -0,0 +1,10 @@
+#pragma once
+
+#include <xv6/proc.h>
+
+void fpuinit(void);
+void fputrap(void);
+void fpuswitchin(struct proc *p);
+void fpuswitchout(struct proc *p);
+int fpucopy(struct proc *np, struct proc *p);
+void fpufree(struct proc *p);
@@ -24,11 +24,34 @@ struct superblock {
   uint logstart;   // Block number of first log block
   uint inodestart; // Block number of first inode block
   uint bmapstart;  // Block number of first free map block
+  uint bsize;      // Block size (bytes), must be BSIZE
+  uint flags;      // FS_* below
 };
 
-#define NDIRECT   12
+// File data goes straight home instead of through the log; only
+// metadata is logged, and data is written before the commit that
+// refers to it (ordered mode). mkfs -o sets it.
+#define FS_ORDERED 0x1
+// Commits wait for a timer or a full log, or for fsync() or sync(),
+// instead of happening when the operations in flight end; a crash
+// may lose the last few seconds of work. mkfs -d sets it.
+#define FS_DELAYED 0x2
+
+// The log (nlog blocks) starts with a header: a count n, a checksum,
+// then the block numbers of the n logged blocks. The header takes as
+// many blocks as it needs, LOGHEAD(nlog) of them, and the logged
+// blocks follow it. LOGMAX makes the header at most 2 blocks long.
+#define LOGMAX     (2 * BSIZE / sizeof(int) - 2)
+#define LOGHEAD(n) \
+  ((((n) + 2) * sizeof(int) + BSIZE + sizeof(int) - 1) / (BSIZE + sizeof(int)))
+
+// addrs[NDIRECT] is a single-indirect block and addrs[NDIRECT + 1]
+// a double-indirect one. That covers more than the 4 GiB a uint
+// size can describe.
+#define NDIRECT   11
+#define NLEVEL    2
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE   (NDIRECT + NINDIRECT)
+#define MAXFILE   (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -37,7 +60,7 @@ struct dinode {
   short minor;             // Minor device number (T_DEV only)
   short nlink;             // Number of links to inode in file system
   uint size;               // Size of file (bytes)
-  uint addrs[NDIRECT + 1]; // Data block addresses
+  uint addrs[NDIRECT + NLEVEL]; // Data block addresses
 };
 
 // Inodes per block.
@@ -75,7 +98,8 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT + 1];
+  uint addrs[NDIRECT + NLEVEL];
+  uint goal; // where to look for the next block (0: anywhere)
 };
 
 void readsb(int dev, struct superblock *sb);
@@ -92,6 +116,8 @@ void iupdate(struct inode *ip);
 int namecmp(const char *s, const char *t);
 struct inode *namei(const char *path);
 struct inode *nameiparent(const char *path, char *name);
+struct readahead;
+void readahead(struct inode *ip, struct readahead *ra, uint off, uint n);
 int readi(struct inode *ip, char *dst, uint off, uint n);
 void stati(struct inode *ip, struct stat *st);
 int writei(struct inode *ip, const char *src, uint off, uint n);
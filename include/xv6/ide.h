@@ -2,6 +2,8 @@
 
 #include <xv6/bio.h>
 
+void idedump(void);
 void ideinit(void);
 void ideintr(void);
-void iderw(struct buf *b);
\ No newline at end of file
+uchar *idemap(uint dev, uint blockno);
+void idesubmit(struct buf *b);
\ No newline at end of file
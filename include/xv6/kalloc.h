@@ -14,5 +14,6 @@ extern struct kmap kmap[KMAP_MAX_SIZE];
 void kmap_add(ulong pa_start, ulong pa_end, ulong perm, int heap);
 void *kalloc(void);
 void kfree(void *va);
+int kfreepages(void);
 void kinit1(void);
 void kinit2(void);
@@ -3,6 +3,12 @@
 #include <xv6/bio.h>
 
 void initlog(int dev);
+int log_maxop(void);
+void log_free(uint blockno);
+void log_sync(void);
 void log_write(struct buf *b);
+void log_writedata(struct buf *b);
 void begin_op(void);
-void end_op(void);
\ No newline at end of file
+void begin_opn(int n);
+void end_op(void);
+void end_opn(int n);
\ No newline at end of file
@@ -31,11 +31,13 @@
 #define PGALIGNED(a)   (!((a) & (PGSIZE - 1)))
 
 // Page table/directory entry flags.
-#define PTE_P  0x001UL // Present
-#define PTE_W  0x002UL // Writeable
-#define PTE_U  0x004UL // User
-#define PTE_PS 0x080UL // Page Size
-#define PTE_XD (1UL << 63)
+#define PTE_P   0x001UL // Present
+#define PTE_W   0x002UL // Writeable
+#define PTE_U   0x004UL // User
+#define PTE_PWT 0x008UL // Write-Through
+#define PTE_PCD 0x010UL // Cache-Disable
+#define PTE_PS  0x080UL // Page Size
+#define PTE_XD  (1UL << 63)
 
 #ifndef __ASSEMBLER__
 #include <xv6/types.h>
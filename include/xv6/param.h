@@ -10,6 +10,11 @@
 #define ROOTDEV     1                 // device number of file system root disk
 #define MAXARG      32                // max exec arguments
 #define MAXOPBLOCKS 10                // max # of blocks any FS op writes
-#define LOGSIZE     (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF        (MAXOPBLOCKS * 3) // size of disk block cache
-#define FSSIZE      1000              // size of file system in blocks
+#define LOGSIZE     (MAXOPBLOCKS * 3) // min size of on-disk log (blocks)
+#define NBUF        (MAXOPBLOCKS * 3) // minimum size of disk block cache
+#define NBUFMAX     2048              // maximum size of disk block cache
+#define NTRANS      2                 // log transactions frozen and not yet installed
+// Most blocks a log transaction holds. Logged blocks stay pinned in
+// the cache until installed, for the running transaction and NTRANS
+// frozen ones, and NBUF buffers are left for everything else.
+#define LOGBLOCKS   ((NBUFMAX - NBUF) / (NTRANS + 1))
@@ -0,0 +1,41 @@
+// PCI configuration space access.
+// https://wiki.osdev.org/PCI
+
+#pragma once
+
+#include <xv6/types.h>
+
+// Configuration space register offsets
+#define PCI_ID      0x00 // device id << 16 | vendor id
+#define PCI_CMD     0x04 // status << 16 | command
+#define PCI_CLASS   0x08 // class, subclass, prog if, revision (high to low)
+#define PCI_HEADER  0x0c // header type in bits 16-23
+#define PCI_BAR0    0x10 // base address registers, 6 of them
+#define PCI_CAP     0x34 // capabilities list pointer
+#define PCI_INTR    0x3c // interrupt pin << 8 | interrupt line
+
+// Capability ids
+#define PCI_CAP_MSI  0x05
+#define PCI_CAP_MSIX 0x11
+
+// Command register bits
+#define PCI_CMD_IO      0x1   // respond to I/O space accesses
+#define PCI_CMD_MEM     0x2   // respond to memory space accesses
+#define PCI_CMD_MASTER  0x4   // may act as a bus master (DMA)
+#define PCI_CMD_INTXOFF 0x400 // don't assert INTx
+
+struct pcidev {
+  uchar bus, dev, func;
+  ushort vendor, device;
+  uchar class, subclass, progif;
+};
+
+int pcifindclass(uint class, uint subclass, struct pcidev *pd);
+int pcifindid(uint vendor, uint device, struct pcidev *pd);
+uint pciread(struct pcidev *pd, uint off);
+void pciwrite(struct pcidev *pd, uint off, uint val);
+ulong pcibar(struct pcidev *pd, int n);
+uint pcifindcap(struct pcidev *pd, uint id);
+int pcimsienable(struct pcidev *pd, int vector, int apicid);
+volatile uint *pcimsixenable(struct pcidev *pd, int *nvec);
+void pcimsixroute(volatile uint *table, int entry, int vector, int apicid);
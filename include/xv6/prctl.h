@@ -0,0 +1,5 @@
+#pragma once
+
+// arch_prctl() codes
+#define ARCH_SET_FS 0x1002 // set the FS base (thread pointer) to addr
+#define ARCH_GET_FS 0x1003 // store the FS base at *(ulong *)addr
@@ -17,6 +17,7 @@ struct cpu {
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
   struct proc *proc;         // The process running on this cpu or null
+  struct proc *fpuowner;     // Process whose FPU state is in the registers
 };
 
 extern struct cpu cpus[NCPU];
@@ -59,6 +60,10 @@ struct proc {
   struct file *ofile[NOFILE]; // Open files
   struct inode *cwd;          // Current directory
   char name[16];              // Process name (debugging)
+  char *fpu;                  // Saved FPU/SIMD state, or 0 if never used
+  int fpucpu;                 // CPU whose registers match *fpu, or -1
+  ulong fsbase;               // User FS base (TLS thread pointer)
+  ulong gsbase;               // User GS base (settable only with FSGSBASE)
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -72,6 +77,7 @@ void exit(void);
 int fork(void);
 int growproc(int n);
 int kill(int pid);
+void kthreadcreate(void (*fn)(void), const char *name);
 struct cpu *mycpu(void);
 struct proc *myproc(void);
 void pinit(void);
@@ -8,6 +8,8 @@
 struct sleeplock {
   uint locked;        // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *owner; // Process holding lock
+  int nwaiters;       // Processes sleeping on the lock
 
   // For debugging:
   const char *name; // Name of lock.
@@ -17,4 +19,4 @@ struct sleeplock {
 void initsleeplock(struct sleeplock *lk, const char *name);
 void acquiresleep(struct sleeplock *lk);
 void releasesleep(struct sleeplock *lk);
-int holdingsleep(struct sleeplock *lk);
\ No newline at end of file
+int holdingsleep(struct sleeplock *lk);
@@ -4,20 +4,25 @@
 
 #include <xv6/types.h>
 
+// Ticket lock: acquirers take a ticket from next and wait until
+// owner reaches it, so the lock is handed out in FIFO order.
 struct spinlock {
-  uint locked; // Is the lock held?
+  uint next;  // Next ticket to hand out.
+  uint owner; // Ticket currently allowed to hold the lock.
 
   // For debugging:
   const char *name; // Name of lock.
   struct cpu *cpu;  // The cpu holding the lock.
   ulong pcs[10];    // The call stack (an array of program counters)
                     // that locked the lock.
+  int stat;         // Index into the per-cpu contention statistics.
 };
 
 void acquire(struct spinlock *lk);
 void getcallerpcs(ulong pcs[]);
 int holding(struct spinlock *lk);
 void initlock(struct spinlock *lk, const char *name);
+void lockdump(void);
 void release(struct spinlock *lk);
 void pushcli(void);
-void popcli(void);
\ No newline at end of file
+void popcli(void);
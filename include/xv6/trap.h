@@ -47,19 +47,6 @@ struct gatedesc {
 //  hardware and by trapasm.S, and passed to trap().
 struct trapframe {
   // rest of trap frame
-  ushort gs;
-  ushort padding0;
-  uint padding1;
-  ushort fs;
-  ushort padding2;
-  uint padding3;
-  ushort es;
-  ushort padding4;
-  uint padding5;
-  ushort ds;
-  ushort padding6;
-  uint padding7;
-
   ulong r9;
   ulong r8;
   ulong rcx;
@@ -25,6 +25,9 @@ int getpid(void);
 char *sbrk(int n);
 int sleep(int seconds);
 int uptime(void);
+int arch_prctl(int code, ulong addr);
+int fsync(int fd);
+int sync(void);
 
 // ulib.c
 int stat(const char *n, struct stat *st);
@@ -10,6 +10,7 @@ int exec(char *, char **);
 
 // In vm.c
 void seginit(void);
+void kmapdev(ulong pa, ulong size);
 void kvmalloc(void);
 pte_t *setupkvm(void);
 ulong uva2ka(pte_t *pml4, ulong uva);
@@ -21,5 +22,7 @@ int loaduvm(pte_t *pml4, ulong addr, struct inode *ip, uint offset, uint sz);
 pte_t *copyuvm(pte_t *pml4, ulong sz);
 void switchuvm(struct proc *p);
 void switchkvm(void);
+void saveuvm(struct proc *p);
+void setfsbase(ulong base);
 int copyout(pte_t *pml4, ulong va, ulong p, ulong len);
 void clearpteu(pte_t *pml4, ulong uva);
\ No newline at end of file
@@ -13,6 +13,20 @@ static inline uchar inb(ushort port) {
   return data;
 }
 
+static inline ushort inw(ushort port) {
+  ushort data;
+
+  asm volatile("inw %1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
+
+static inline uint inl(ushort port) {
+  uint data;
+
+  asm volatile("inl %1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
+
 static inline void insl(ushort port, void *addr, int cnt) {
   asm volatile("cld; rep insl"
                : "=D"(addr), "=c"(cnt)
@@ -28,6 +42,10 @@ static inline void outw(ushort port, ushort data) {
   asm volatile("outw %0,%1" : : "a"(data), "d"(port));
 }
 
+static inline void outl(ushort port, uint data) {
+  asm volatile("outl %0,%1" : : "a"(data), "d"(port));
+}
+
 static inline void outsl(ushort port, const void *addr, int cnt) {
   asm volatile("cld; rep outsl"
                : "=S"(addr), "=c"(cnt)
@@ -98,6 +116,22 @@ static inline uint xchg(volatile uint *addr, uint newval) {
   return result;
 }
 
+// Atomically add inc to *addr and return the old value.
+static inline uint xadd(volatile uint *addr, uint inc) {
+  asm volatile("lock; xaddl %0, %1" : "+r"(inc), "+m"(*addr) : : "cc");
+  return inc;
+}
+
+// Spin-wait hint: saves power and avoids a memory-order
+// mis-speculation penalty when the loop exits.
+static inline void pause(void) { asm volatile("pause"); }
+
+static inline ulong rdtsc(void) {
+  uint lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((ulong)hi << 32) | lo;
+}
+
 static inline ulong rcr2(void) {
   ulong val;
   asm volatile("movq %%cr2,%0" : "=r"(val));
@@ -108,6 +142,70 @@ static inline void lcr3(ulong val) {
   asm volatile("movq %0,%%cr3" : : "r"(val));
 }
 
+static inline ulong rdmsr(uint msr) {
+  uint lo, hi;
+  asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((ulong)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint msr, ulong val) {
+  asm volatile("wrmsr" : : "c"(msr), "a"((uint)val), "d"((uint)(val >> 32)));
+}
+
+static inline ulong rdfsbase(void) {
+  ulong val;
+  asm volatile("rdfsbase %0" : "=r"(val));
+  return val;
+}
+
+static inline void wrfsbase(ulong val) {
+  asm volatile("wrfsbase %0" : : "r"(val));
+}
+
+static inline ulong rdgsbase(void) {
+  ulong val;
+  asm volatile("rdgsbase %0" : "=r"(val));
+  return val;
+}
+
+static inline void wrgsbase(ulong val) {
+  asm volatile("wrgsbase %0" : : "r"(val));
+}
+
+static inline ulong rcr0(void) {
+  ulong val;
+  asm volatile("movq %%cr0,%0" : "=r"(val));
+  return val;
+}
+
+static inline void lcr0(ulong val) {
+  asm volatile("movq %0,%%cr0" : : "r"(val));
+}
+
+static inline ulong rcr4(void) {
+  ulong val;
+  asm volatile("movq %%cr4,%0" : "=r"(val));
+  return val;
+}
+
+static inline void lcr4(ulong val) {
+  asm volatile("movq %0,%%cr4" : : "r"(val));
+}
+
+// Clear CR0.TS.
+static inline void clts(void) { asm volatile("clts"); }
+
+static inline void xsetbv(uint reg, ulong val) {
+  asm volatile("xsetbv" : : "c"(reg), "a"((uint)val), "d"((uint)(val >> 32)));
+}
+
+static inline void readcpuid(uint leaf, uint subleaf, uint *a, uint *b,
+                             uint *c, uint *d) {
+  asm volatile("cpuid"
+               : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+               : "a"(leaf), "c"(subleaf));
+}
+
 #endif
 
 #define DPL_USER 3
@@ -117,12 +215,34 @@ static inline void lcr3(ulong val) {
 
 // Control Register flags
 #define CR0_PE 0x00000001 // Protection Enable
+#define CR0_MP 0x00000002 // Monitor coProcessor
+#define CR0_EM 0x00000004 // Emulation
+#define CR0_TS 0x00000008 // Task Switched
+#define CR0_NE 0x00000020 // Numeric Error
 #define CR0_WP 0x00010000 // Write Protect
 #define CR0_PG 0x80000000 // Paging
 
 #define CR4_PSE 0x00000010 // Page Size Extension
 #define CR4_PAE 0x00000020 // Page Address Extension
-
-#define IA32_EFER 0xC0000080
+#define CR4_OSFXSR     0x00000200 // OS supports FXSAVE/FXRSTOR
+#define CR4_OSXMMEXCPT 0x00000400 // OS handles SIMD FP exceptions
+#define CR4_FSGSBASE   0x00010000 // Enable RDFSBASE/WRFSBASE etc.
+#define CR4_OSXSAVE    0x00040000 // OS supports XSAVE and XCR0
+
+// Extended control register 0 (state components managed by XSAVE)
+#define XCR0_X87 0x1
+#define XCR0_SSE 0x2
+#define XCR0_AVX 0x4
+
+// CPUID leaf 1 feature flags
+#define CPUID1_EDX_FXSR  (1U << 24)
+#define CPUID1_ECX_XSAVE (1U << 26)
+#define CPUID1_ECX_AVX   (1U << 28)
+
+// CPUID leaf 7 feature flags
+#define CPUID7_EBX_FSGSBASE (1U << 0)
+
+#define IA32_EFER    0xC0000080
+#define MSR_FS_BASE  0xC0000100
 #define EFER_LME  0x100
 #define EFER_NXE  0x800
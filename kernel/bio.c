@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,77 +12,358 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To overlap I/O, breada and bwriteasync start a transfer and
+//     give up the buffer; it is released when the transfer ends.
 //
-// The implementation uses two state flags internally:
+// The implementation uses these state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_BUSY: the buffer is queued at or being moved by the driver.
+//     bsubmit sets it, the driver's call to biodone clears it.
+// * B_ASYNC: nobody will bwait for the transfer; biodone releases
+//     the buffer instead.
+//
+// Locking: each hash bucket has its own lock, protecting its chain
+// and the refcnt and used bits of the buffers on it, so lookups of
+// different blocks run in parallel. bcache.lock serializes eviction,
+// growing and shrinking: only the holder moves a buffer between
+// buckets or changes its dev and blockno, and it takes bucket locks
+// one at a time after bcache.lock, never the other way round.
+//
+// Sizing: buffers come in groups of BPERPG sharing one kalloc'd page
+// of data. The cache starts with enough groups for NBUF buffers,
+// adds a group on a miss while free memory is above BLOWATER, and
+// gives idle groups back when kalloc runs dry (bshrink).
+//
+// If the driver keeps the disk in memory (idemap), a buf holds no
+// copy of its block: its data points at the block itself, and it
+// is valid from the start.
 
 #include <xv6/bio.h>
 #include <xv6/console.h>
 #include <xv6/ide.h>
+#include <xv6/kalloc.h>
+#include <xv6/mmu.h>
 #include <xv6/param.h>
+#include <xv6/proc.h>
+#include <xv6/string.h>
 #include <xv6/types.h>
 
-static struct {
+#if BSIZE > PGSIZE
+#error "a buffer's data must fit in one page"
+#endif
+
+#define NBUCKET 251              // prime, so block numbers spread over the buckets
+#define BPERPG (PGSIZE / BSIZE)  // buffers per data page
+#define NGROUP (NBUFMAX / BPERPG)
+#define NGROUPMIN ((NBUF + BPERPG - 1) / BPERPG)
+#define BLOWATER 1024 // free pages below which the cache stops growing
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+  uint nhit; // lookups that found the block here
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+static struct {
+  struct spinlock lock; // serializes eviction and resizing
+  struct buf buf[NBUFMAX];
+  uchar *page[NGROUP]; // data page of each group, 0 if not in use
+  int ngroup;          // groups in use
+  struct bucket bucket[NBUCKET];
+  uint hand; // clock hand: next buf to consider for eviction
+
+  // Statistics, protected by lock.
+  uint nmiss, nevict, ngrow, nshrink;
 } bcache;
 
-void binit(void) {
+// Protects B_BUSY, so bwait can sleep until biodone clears it.
+// Drivers call biodone holding their own lock, so this one comes
+// after any driver lock.
+static struct spinlock biolock;
+
+// The slot of b in its group's data page.
+static uchar *bdata(struct buf *b) {
+  int i = b - bcache.buf;
+
+  return bcache.page[i / BPERPG] + (i % BPERPG) * BSIZE;
+}
+
+static struct bucket *bhash(uint dev, uint blockno) {
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Add a group of buffers backed by a fresh page.
+// New buffers go on the bucket of block 0, like at boot.
+// Caller holds bcache.lock.
+static int bgrow(void) {
+  struct bucket *bk;
   struct buf *b;
+  uchar *pg;
+  int g;
 
-  initlock(&bcache.lock, "bcache");
+  for (g = 0; g < NGROUP && bcache.page[g]; g++)
+    ;
+  if (g == NGROUP || (pg = kalloc()) == 0)
+    return 0;
+  bcache.page[g] = pg;
+  bcache.ngroup++;
+  bcache.ngrow++;
 
-  //  Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  bk = bhash(0, 0);
+  for (b = &bcache.buf[g * BPERPG]; b < &bcache.buf[(g + 1) * BPERPG]; b++) {
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = pg;
+    pg += BSIZE;
+    b->dev = 0;
+    b->blockno = 0;
+    b->flags = 0;
+    b->refcnt = 0;
+    b->used = 0;
+    acquire(&bk->lock);
+    b->hnext = bk->head;
+    bk->head = b;
+    release(&bk->lock);
   }
+  return 1;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
-  struct buf *b;
+void binit(void) {
+  struct bucket *bk;
+
+  initlock(&bcache.lock, "bcache");
+  initlock(&biolock, "bio");
+  for (bk = bcache.bucket; bk < bcache.bucket + NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+
+  acquire(&bcache.lock);
+  while (bcache.ngroup < NGROUPMIN)
+    if (!bgrow())
+      panic("binit");
+  release(&bcache.lock);
+}
+
+// Unhook b from its bucket if nobody is using it.
+// Caller holds bcache.lock.
+static int bunlink(struct buf *b) {
+  struct bucket *bk;
+  struct buf **pp;
+  int ok;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+  // because log.c has modified it but not yet committed it.
+  ok = b->refcnt == 0 && (b->flags & B_DIRTY) == 0;
+  if (ok) {
+    for (pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+      ;
+    *pp = b->hnext;
+  }
+  release(&bk->lock);
+  return ok;
+}
+
+// Give an idle group of buffers back to the page allocator.
+// Called by kalloc when it runs out of memory.
+// Returns 1 if a page was freed.
+int bshrink(void) {
+  struct bucket *bk;
+  struct buf *b, *first;
+  int g, freed = 0;
+
+  // bgrow calls kalloc with bcache.lock held.
+  if (holding(&bcache.lock))
+    return 0;
 
   acquire(&bcache.lock);
+  for (g = 0; g < NGROUP && bcache.ngroup > NGROUPMIN; g++) {
+    if (bcache.page[g] == 0)
+      continue;
+    first = &bcache.buf[g * BPERPG];
+    for (b = first; b < first + BPERPG; b++)
+      if (!bunlink(b))
+        break;
+    if (b == first + BPERPG) {
+      kfree(bcache.page[g]);
+      bcache.page[g] = 0;
+      bcache.ngroup--;
+      bcache.nshrink++;
+      freed = 1;
+      break;
+    }
+    // Someone is using the group; put back what we took.
+    while (b-- > first) {
+      bk = bhash(b->dev, b->blockno);
+      acquire(&bk->lock);
+      b->hnext = bk->head;
+      bk->head = b;
+      release(&bk->lock);
+    }
+  }
+  release(&bcache.lock);
+  return freed;
+}
 
-  // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+// Find the block in its bucket and take a reference.
+// Caller holds bk->lock.
+static struct buf *blookup(struct bucket *bk, uint dev, uint blockno) {
+  struct buf *b;
+
+  for (b = bk->head; b; b = b->hnext) {
     if (b->dev == dev && b->blockno == blockno) {
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+// Pick an unused buffer with the clock algorithm, unhook it from
+// its bucket and return it with refcnt 1.
+// Caller holds bcache.lock.
+static struct buf *bevict(void) {
+  struct bucket *bk;
+  struct buf *b, **pp;
+  int i;
+
+  // Two sweeps: the first may only clear used bits.
+  for (i = 0; i < 2 * bcache.ngroup * BPERPG;) {
+    if (bcache.hand >= NBUFMAX)
+      bcache.hand = 0;
+    if (bcache.page[bcache.hand / BPERPG] == 0) {
+      bcache.hand += BPERPG;
+      continue;
+    }
+    b = &bcache.buf[bcache.hand++];
+    i++;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
     if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      if (b->used) {
+        b->used = 0;
+      } else {
+        for (pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+          ;
+        *pp = b->hnext;
+        b->refcnt = 1;
+        release(&bk->lock);
+        return b;
+      }
     }
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf *bget(uint dev, uint blockno) {
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  if (b)
+    bk->nhit++;
+  release(&bk->lock);
+  if (b) {
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached. Only bcache.lock holders insert blocks, so once we
+  // hold it a second look settles whether it is really missing.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  if (b)
+    bk->nhit++;
+  release(&bk->lock);
+  if (b == 0) {
+    bcache.nmiss++;
+    // Grow while memory is plentiful, else recycle an unused
+    // buffer, and grow anyway if every buffer is pinned.
+    if (kfreepages() > BLOWATER)
+      bgrow();
+    if ((b = bevict()) == 0 && (!bgrow() || (b = bevict()) == 0))
+      panic("bget: no buffers");
+    if (b->flags & B_VALID)
+      bcache.nevict++;
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    if ((b->data = idemap(dev, blockno)) != 0)
+      b->flags = B_VALID;
+    else
+      b->data = bdata(b);
+    acquire(&bk->lock);
+    b->hnext = bk->head;
+    bk->head = b;
+    release(&bk->lock);
+  }
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Hand locked buf b to the disk driver and return at once.
+// If B_DIRTY is set, write buf to disk, else read it.
+// Use bwait to wait for the transfer to finish.
+void bsubmit(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("bsubmit: buf not locked");
+  if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
+    panic("bsubmit: nothing to do");
+  if (b->flags & B_BUSY)
+    panic("bsubmit: busy");
+
+  // Not yet visible to the driver, so no lock needed.
+  b->flags |= B_BUSY;
+  idesubmit(b);
+}
+
+// Wait for the transfer started by bsubmit to finish.
+// Afterwards B_VALID is set and B_DIRTY is clear.
+void bwait(struct buf *b) {
+  acquire(&biolock);
+  while (b->flags & B_BUSY)
+    sleep(b, &biolock);
+  release(&biolock);
+}
+
+// Release a buffer on behalf of the process that locked it.
+static void brelseasync(struct buf *b) {
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  b->used = 1;
+  release(&bk->lock);
+}
+
+// Called by the disk driver, possibly from an interrupt,
+// when the transfer of b finishes.
+void biodone(struct buf *b) {
+  int async;
+
+  acquire(&biolock);
+  async = b->flags & B_ASYNC;
+  b->flags |= B_VALID;
+  b->flags &= ~(B_DIRTY | B_BUSY | B_ASYNC);
+  wakeup(b);
+  release(&biolock);
+
+  if (async)
+    brelseasync(b);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -91,38 +372,95 @@ struct buf *bread(uint dev, uint blockno) {
 
   b = bget(dev, blockno);
   if ((b->flags & B_VALID) == 0) {
-    iderw(b);
+    bsubmit(b);
+    bwait(b);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block, zeroed instead of
+// read: for a block just allocated, whose old contents don't matter.
+struct buf *bnew(uint dev, uint blockno) {
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  memset(b->data, 0, BSIZE);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Start reading the indicated block into the cache, without waiting.
+// The buffer stays locked until the read completes, so a later bread
+// of the block sleeps until then. Does nothing if the block is
+// already cached or on its way.
+void breada(uint dev, uint blockno) {
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  if (b)
+    b->refcnt--;
+  release(&bk->lock);
+  if (b)
+    return;
+
+  b = bget(dev, blockno);
+  if (b->flags & B_VALID) {
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  bsubmit(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  bsubmit(b);
+  bwait(b);
+}
+
+// Start writing b's contents to disk and give up b without waiting;
+// it is released when the write completes. Must be locked.
+void bwriteasync(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("bwriteasync");
+  b->flags |= B_DIRTY | B_ASYNC;
+  bsubmit(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Mark it recently used so the clock hand passes it over once.
 void brelse(struct buf *b) {
+  struct bucket *bk;
+
   if (!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+  b->used = 1;
+  release(&bk->lock);
+}
 
-  release(&bcache.lock);
+// Print buffer cache statistics to console. For debugging.
+// Runs when user types ^B on console.
+// No lock, so the numbers may be slightly stale.
+void bdump(void) {
+  uint nhit = 0;
+  int i;
+
+  for (i = 0; i < NBUCKET; i++)
+    nhit += bcache.bucket[i].nhit;
+  cprintf("bcache: %d bufs, %d hits, %d misses, %d evictions, "
+          "%d grows, %d shrinks\n",
+          bcache.ngroup * BPERPG, nhit, bcache.nmiss, bcache.nevict,
+          bcache.ngrow, bcache.nshrink);
+  idedump();
 }
@@ -4,6 +4,7 @@
 
 #include <stdarg.h>
 #include <xv6/apic.h>
+#include <xv6/bio.h>
 #include <xv6/console.h>
 #include <xv6/fb.h>
 #include <xv6/file.h>
@@ -97,7 +98,7 @@ struct {
 } input;
 
 void consoleintr(int (*getc)(void)) {
-  int c, doprocdump = 0;
+  int c, doprocdump = 0, dolockdump = 0, dobdump = 0;
 
   acquire(&cons.lock);
   while ((c = getc()) >= 0) {
@@ -106,6 +107,12 @@ void consoleintr(int (*getc)(void)) {
         // procdump() locks cons.lock indirectly; invoke later
         doprocdump = 1;
         break;
+      case C('L'): // Lock contention listing.
+        dolockdump = 1;
+        break;
+      case C('B'): // Buffer cache statistics.
+        dobdump = 1;
+        break;
       case C('U'): // Kill line.
         while (input.e != input.w &&
                input.buf[(input.e - 1) % INPUT_BUF] != '\n') {
@@ -138,6 +145,12 @@ void consoleintr(int (*getc)(void)) {
   if (doprocdump) {
     procdump(); // now call procdump() wo. cons.lock held
   }
+  if (dolockdump) {
+    lockdump();
+  }
+  if (dobdump) {
+    bdump();
+  }
 }
 
 static int consoleread(struct inode *ip, char *dst, int n) {
@@ -1,5 +1,6 @@
 #include <xv6/console.h>
 #include <xv6/elf.h>
+#include <xv6/fpu.h>
 #include <xv6/fs.h>
 #include <xv6/log.h>
 #include <xv6/misc.h>
@@ -88,6 +89,12 @@ int exec(char *path, char **argv) {
   }
   ustack[1 + argc] = 0UL;
 
+  // The ABI wants %rsp+8 16-byte aligned on entry to a function,
+  // and compiled SSE code relies on it.
+  sp = ALIGN(sp, 16UL);
+  if ((1 + argc + 1) % 2 == 0)
+    sp -= sizeof(ulong);
+
   // fake return PC
   ustack[0] = ~0UL;
   // argc (second argument of main())
@@ -111,8 +118,11 @@ int exec(char *path, char **argv) {
   curproc->sz = sz;
   curproc->tf->rip = elf.entry; // main
   curproc->tf->rsp = sp;
+  curproc->fsbase = 0; // the new image sets up its own TLS
+  curproc->gsbase = 0;
   switchuvm(curproc);
   freevm(oldpml4);
+  fpufree(curproc);
 
   return 0;
 
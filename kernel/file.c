@@ -90,6 +90,7 @@ int fileread(struct file *f, char *addr, int n) {
     return piperead(f->pipe, addr, n);
   if (f->type == FD_INODE) {
     ilock(f->ip);
+    readahead(f->ip, &f->ra, f->off, n);
     if ((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
@@ -109,11 +110,12 @@ int filewrite(struct file *f, char *addr, int n) {
   if (f->type == FD_INODE) {
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
+    // i-node, indirect blocks, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * 512;
+    int nop = log_maxop();
+    int max = ((nop - 1 - 1 - 2) / 2) * BSIZE;
     int i = 0; // bytes written so far
     while (i < n) {
       int n1 = n - i; // bytes to write in this iteration
@@ -122,12 +124,12 @@ int filewrite(struct file *f, char *addr, int n) {
         // there's no limit in write size for a character device
         n1 = max;
 
-      begin_op();
+      begin_opn(nop);
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nop);
 
       if (r < 0)
         break;
@@ -0,0 +1,175 @@
+// Lazy FPU/SIMD context switching.
+//
+// User processes may use x87, SSE and, where the CPU has it, AVX.
+// The kernel is built with -mno-sse and never touches those
+// registers, so they only have to change hands when a different
+// process wants them.
+//
+// Each CPU remembers whose state is loaded in its registers
+// (c->fpuowner). When a process is scheduled, CR0.TS is set unless
+// that process already owns the registers; its first FPU
+// instruction then raises #NM (T_DEVICE) and fputrap() loads its
+// saved state. A process that ran with TS clear is saved to p->fpu
+// when it is switched out, so it can resume on any CPU; p->fpucpu
+// records which CPU still holds a matching copy, so that nothing
+// is reloaded if it runs there next.
+//
+// p->fpu is allocated on first use, so processes that never touch
+// the FPU pay nothing.
+
+#include <xv6/console.h>
+#include <xv6/fpu.h>
+#include <xv6/kalloc.h>
+#include <xv6/mmu.h>
+#include <xv6/proc.h>
+#include <xv6/string.h>
+#include <xv6/types.h>
+#include <xv6/x86.h>
+
+static int usexsave; // XSAVE/XRSTOR available, else FXSAVE/FXRSTOR
+static ulong xcr0;   // state components enabled in XCR0
+
+// Set up FPU/SIMD support. Run once on entry on each CPU.
+void fpuinit(void) {
+  uint a, b, c, d;
+  ulong cr4;
+
+  readcpuid(1, 0, &a, &b, &c, &d);
+  if (!(d & CPUID1_EDX_FXSR))
+    panic("fpuinit: no fxsave");
+
+  // Report x87 errors natively, don't emulate, and trap on the
+  // first FPU instruction of whoever runs next.
+  lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+
+  cr4 = rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+  if (c & CPUID1_ECX_XSAVE)
+    cr4 |= CR4_OSXSAVE;
+  lcr4(cr4);
+
+  if (c & CPUID1_ECX_XSAVE) {
+    usexsave = 1;
+    xcr0 = XCR0_X87 | XCR0_SSE;
+    if (c & CPUID1_ECX_AVX)
+      xcr0 |= XCR0_AVX;
+    xsetbv(0, xcr0);
+    // Size of the save area for the components enabled in XCR0.
+    readcpuid(0xd, 0, &a, &b, &c, &d);
+    if (b > PGSIZE)
+      panic("fpuinit: xsave area too big");
+  }
+
+  mycpu()->fpuowner = 0;
+}
+
+static void fpusave(char *area) {
+  if (usexsave)
+    asm volatile("xsave64 (%0)"
+                 :
+                 : "r"(area), "a"((uint)xcr0), "d"((uint)(xcr0 >> 32))
+                 : "memory");
+  else
+    asm volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+static void fpurestore(char *area) {
+  if (usexsave)
+    asm volatile("xrstor64 (%0)"
+                 :
+                 : "r"(area), "a"((uint)xcr0), "d"((uint)(xcr0 >> 32))
+                 : "memory");
+  else
+    asm volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+// Set CR0.TS so that the next FPU instruction traps.
+static void stts(void) { lcr0(rcr0() | CR0_TS); }
+
+// #NM from user space: give the FPU to the current process,
+// loading its saved state unless the registers still hold it.
+void fputrap(void) {
+  struct proc *p = myproc();
+  struct cpu *c;
+
+  if (p->fpu == 0) {
+    if ((p->fpu = kalloc()) == 0) {
+      cprintf("pid %d %s: no memory for fpu state--kill proc\n", p->pid,
+              p->name);
+      p->killed = 1;
+      return;
+    }
+    // Empty XSAVE header: every component starts in its initial
+    // state. FXRSTOR has no such notion, so spell out the control
+    // words it would otherwise load as zero.
+    memset(p->fpu, 0, PGSIZE);
+    *(ushort *)(p->fpu + 0) = 0x37f;  // FCW: all exceptions masked
+    *(uint *)(p->fpu + 24) = 0x1f80; // MXCSR: all exceptions masked
+  }
+
+  pushcli();
+  c = mycpu();
+  clts();
+  if (c->fpuowner != p || p->fpucpu != c - cpus)
+    fpurestore(p->fpu);
+  c->fpuowner = p;
+  p->fpucpu = c - cpus;
+  popcli();
+}
+
+// p is about to run on this CPU. Caller must hold ptable.lock.
+void fpuswitchin(struct proc *p) {
+  struct cpu *c = mycpu();
+
+  if (c->fpuowner == p && p->fpucpu == c - cpus)
+    clts();
+  else
+    stts();
+}
+
+// p has just been switched out of this CPU. If it had the FPU,
+// save its registers. Caller must hold ptable.lock.
+void fpuswitchout(struct proc *p) {
+  struct cpu *c = mycpu();
+
+  if (rcr0() & CR0_TS)
+    return;
+  if (p->state == ZOMBIE)
+    c->fpuowner = 0;
+  else
+    fpusave(p->fpu);
+  stts();
+}
+
+// Give np a copy of p's FPU state (for fork).
+// Returns 0 on success, -1 on failure.
+int fpucopy(struct proc *np, struct proc *p) {
+  np->fpu = 0;
+  np->fpucpu = -1;
+  if (p->fpu == 0)
+    return 0;
+  if ((np->fpu = kalloc()) == 0)
+    return -1;
+
+  // Flush the live registers if p is using the FPU right now.
+  pushcli();
+  if (!(rcr0() & CR0_TS))
+    fpusave(p->fpu);
+  popcli();
+
+  memmove(np->fpu, p->fpu, PGSIZE);
+  return 0;
+}
+
+// Discard p's FPU state (for exec and when p is freed).
+void fpufree(struct proc *p) {
+  pushcli();
+  if (mycpu()->fpuowner == p) {
+    mycpu()->fpuowner = 0;
+    stts();
+  }
+  popcli();
+  if (p->fpu)
+    kfree(p->fpu);
+  p->fpu = 0;
+  p->fpucpu = -1;
+}
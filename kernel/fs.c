@@ -15,11 +15,13 @@
 #include <xv6/log.h>
 #include <xv6/param.h>
 #include <xv6/proc.h>
+#include <xv6/spinlock.h>
 #include <xv6/stat.h>
 #include <xv6/string.h>
 #include <xv6/types.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 static void itrunc(struct inode *);
 // there should be one superblock per disk device, but we run with
 // only one device
@@ -38,33 +40,119 @@ void readsb(int dev, struct superblock *sb) {
 static void bzero(int dev, int bno) {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bnew(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// The allocator looks for a free block from a goal onwards, usually
+// just past the caller's last block, so a file written in order gets
+// contiguous blocks. If the goal itself is taken, it prefers the
+// start of a free run (a whole free byte of the bitmap, BRUN blocks)
+// to a lone free block, so the file can go on growing in place.
+// bfreecnt[] counts the free blocks under each bitmap block, so
+// stretches of the disk with no room are skipped without reading
+// their bitmap. A count is BFREEUNKNOWN until the bitmap block is
+// first read; updates happen with the bitmap block locked. Bitmap
+// blocks beyond the first NBFREE are always searched.
+
+#define NBFREE       4096 // bitmap blocks with a free count
+#define BFREEUNKNOWN 0xffff
+#define BRUN         8 // blocks in a free run
+
+static ushort bfreecnt[NBFREE];
+
+// Goal for allocations that have none: just past the last block
+// allocated.
+static struct {
+  struct spinlock lock;
+  uint next;
+} brover;
 
-// Allocate a zeroed disk block.
-static uint balloc(uint dev) {
-  int b, bi, m;
-  struct buf *bp;
+// Count the free blocks under bitmap block bp, number bi.
+static void bcount(struct buf *bp, uint bi) {
+  uint b, n = 0;
+
+  for (b = 0; b < BPB && bi * BPB + b < sb.size; b++)
+    if ((bp->data[b / 8] & (1 << (b % 8))) == 0)
+      n++;
+  bfreecnt[bi] = n;
+}
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) { // Is block free?
-        bp->data[bi / 8] |= m;           // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+// Allocate a block under bitmap block bi, looking from bit start
+// on: if first, bit start itself; if run, the start of a free run;
+// else any free block. Returns 0 if there is none (block 0, the
+// boot block, is never free).
+static uint bscan(uint dev, uint bi, uint start, int first, int run) {
+  struct buf *bp;
+  uint b, i, lim;
+
+  bp = bread(dev, sb.bmapstart + bi);
+  if (bi < NBFREE && bfreecnt[bi] == BFREEUNKNOWN)
+    bcount(bp, bi);
+  lim = min(BPB, sb.size - bi * BPB);
+  b = lim;
+  if (first && start < lim && (bp->data[start / 8] & (1 << (start % 8))) == 0) {
+    b = start;
+  } else if (run) {
+    for (i = (start + 7) / 8; (i + 1) * 8 <= lim; i++) {
+      if (bp->data[i] == 0) {
+        b = i * 8;
+        break;
+      }
+    }
+  } else {
+    for (b = start; b < lim; b++) {
+      if (bp->data[b / 8] == 0xff) {
+        b |= 7; // skip a full byte
+        continue;
       }
+      if ((bp->data[b / 8] & (1 << (b % 8))) == 0) // Is block free?
+        break;
     }
+  }
+  if (b >= lim) {
     brelse(bp);
+    return 0;
+  }
+  bp->data[b / 8] |= 1 << (b % 8); // Mark block in use.
+  if (bi < NBFREE)
+    bfreecnt[bi]--;
+  log_write(bp);
+  brelse(bp);
+  return bi * BPB + b;
+}
+
+// Allocate a disk block: goal if it is free, else the first free
+// run from goal on, else the first free block from goal on.
+// Its contents are not zeroed: the caller either zeroes
+// it (bzero) or fills it (bnew).
+static uint balloc(uint dev, uint goal) {
+  uint n, bi, b, nbmap = (sb.size + BPB - 1) / BPB;
+  int run;
+
+  if (goal == 0 || goal >= sb.size) {
+    acquire(&brover.lock);
+    goal = brover.next;
+    release(&brover.lock);
+  }
+  // Each pass looks at the goal's bitmap block from the goal on,
+  // the following ones, then back around to the start of the goal's.
+  for (run = 1; run >= 0; run--) {
+    for (n = 0; n <= nbmap; n++) {
+      bi = (goal / BPB + n) % nbmap;
+      if (bi < NBFREE && bfreecnt[bi] < (run ? BRUN : 1))
+        continue;
+      b = bscan(dev, bi, n == 0 ? goal % BPB : 0, run && n == 0, run);
+      if (b != 0) {
+        acquire(&brover.lock);
+        brover.next = b + 1;
+        release(&brover.lock);
+        return b;
+      }
+    }
   }
   panic("balloc: out of blocks");
 }
@@ -80,8 +168,11 @@ static void bfree(int dev, uint b) {
   if ((bp->data[bi / 8] & m) == 0)
     panic("freeing free block");
   bp->data[bi / 8] &= ~m;
+  if (b / BPB < NBFREE && bfreecnt[b / BPB] != BFREEUNKNOWN)
+    bfreecnt[b / BPB]++;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -162,15 +253,19 @@ void iinit(int dev) {
   int i = 0;
 
   initlock(&icache.lock, "icache");
+  initlock(&brover.lock, "brover");
   for (i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
   }
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d "
-          "bmap start %d\n",
+          "bmap start %d bsize %d flags %x\n",
           sb.size, sb.nblocks, sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+          sb.bmapstart, sb.bsize, sb.flags);
+  if (sb.bsize != BSIZE)
+    panic("iinit: file system block size is not BSIZE");
+  memset(bfreecnt, 0xff, sizeof(bfreecnt));
 }
 
 static struct inode *iget(uint dev, uint inum);
@@ -247,6 +342,7 @@ static struct inode *iget(uint dev, uint inum) {
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->goal = 0;
   release(&icache.lock);
 
   return ip;
@@ -302,7 +398,8 @@ void iunlock(struct inode *ip) {
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
-// case it has to free the inode.
+// case it has to free the inode, begun with begin_op():
+// freeing a big file ends it and begins more (see itrunc).
 void iput(struct inode *ip) {
   acquiresleep(&ip->lock);
   if (ip->valid && ip->nlink == 0) {
@@ -335,36 +432,146 @@ void iunlockput(struct inode *ip) {
 //  The content (data) associated with each inode is stored
 //  in blocks on the disk. The first NDIRECT block numbers
 //  are listed in ip->addrs[].  The next NINDIRECT blocks are
-//  listed in block ip->addrs[NDIRECT].
+//  listed in block ip->addrs[NDIRECT], and the NINDIRECT^2
+//  after those in the blocks listed in block ip->addrs[NDIRECT + 1].
+
+// Allocate a block for ip, just past the last one it got.
+// If zero, zero it; else the caller fills it.
+static uint iballoc(struct inode *ip, int zero) {
+  uint addr;
+
+  addr = balloc(ip->dev, ip->goal);
+  ip->goal = addr + 1;
+  if (zero)
+    bzero(ip->dev, addr);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one, not zeroed:
+// writei() fills it with bnew().
 static uint bmap(struct inode *ip, uint bn) {
   uint addr, *a;
   struct buf *bp;
+  ulong n; // blocks under one entry of ip->addrs[NDIRECT + level - 1]
+  int level;
 
   if (bn < NDIRECT) {
     if ((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = iballoc(ip, 0);
     return addr;
   }
   bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
-    // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  for (level = 1, n = NINDIRECT; bn >= n; level++, n *= NINDIRECT) {
+    if (level == NLEVEL)
+      panic("bmap: out of range");
+    bn -= n;
+  }
+
+  // Walk down the indirect blocks, allocating if necessary.
+  if ((addr = ip->addrs[NDIRECT + level - 1]) == 0)
+    ip->addrs[NDIRECT + level - 1] = addr = iballoc(ip, 1);
+  for (; level > 0; level--) {
+    n /= NINDIRECT;
     bp = bread(ip->dev, addr);
     a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      a[bn] = addr = balloc(ip->dev);
+    if ((addr = a[bn / n]) == 0) {
+      a[bn / n] = addr = iballoc(ip, level > 1);
       log_write(bp);
     }
     brelse(bp);
-    return addr;
+    bn %= n;
+  }
+  return addr;
+}
+
+// Blocks, besides the inode's, that itrunc logs per transaction;
+// the rest of MAXOPBLOCKS is left for the caller's own updates.
+#define TRUNCBLOCKS (MAXOPBLOCKS - 4)
+
+// The blocks a truncation has logged in the current transaction.
+struct trunc {
+  int n;
+  uint block[TRUNCBLOCKS];
+};
+
+// Add those of the n blocks in b that t lacks.
+// Returns 0, having added none, if they don't fit.
+static int tadd(struct trunc *t, uint *b, int n) {
+  int i, j, m = t->n;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < m && t->block[j] != b[i]; j++)
+      ;
+    if (j < m)
+      continue;
+    if (m == TRUNCBLOCKS)
+      return 0;
+    t->block[m++] = b[i];
+  }
+  t->n = m;
+  return 1;
+}
+
+// Free block bn, the last block of ip, and the indirect blocks
+// that held only it. Returns 0, doing nothing, if the blocks it
+// would log don't fit in t.
+static int bunmap(struct inode *ip, uint bn, struct trunc *t) {
+  uint path[NLEVEL + 1]; // data block, then indirect blocks upwards
+  uint idx[NLEVEL + 1];  // index of path[k - 1] in path[k]
+  uint c[NLEVEL + 2], b;
+  struct buf *bp;
+  ulong n;
+  int level, k, top, nc = 0;
+
+  if (bn < NDIRECT) {
+    b = ip->addrs[bn];
+    c[0] = BBLOCK(b, sb);
+    if (!tadd(t, c, 1))
+      return 0;
+    bfree(ip->dev, b);
+    ip->addrs[bn] = 0;
+    return 1;
+  }
+  bn -= NDIRECT;
+  for (level = 1, n = NINDIRECT; bn >= n; level++, n *= NINDIRECT)
+    bn -= n;
+
+  path[level] = ip->addrs[NDIRECT + level - 1];
+  for (k = level; k > 0; k--) {
+    n /= NINDIRECT;
+    idx[k] = bn / n;
+    bn %= n;
+    bp = bread(ip->dev, path[k]);
+    path[k - 1] = ((uint *)bp->data)[idx[k]];
+    brelse(bp);
+  }
+
+  // path[k] goes if bn is the first block under it; the
+  // lowest indirect block that stays loses its entry.
+  for (top = 1; top <= level && idx[top] == 0; top++)
+    ;
+  for (k = 0; k < top; k++) {
+    b = path[k];
+    c[nc++] = BBLOCK(b, sb);
   }
+  if (top <= level)
+    c[nc++] = path[top];
+  if (!tadd(t, c, nc))
+    return 0;
 
-  panic("bmap: out of range");
+  for (k = 0; k < top; k++)
+    bfree(ip->dev, path[k]);
+  if (top <= level) {
+    bp = bread(ip->dev, path[top]);
+    ((uint *)bp->data)[idx[top]] = 0;
+    log_write(bp);
+    brelse(bp);
+  } else {
+    ip->addrs[NDIRECT + level - 1] = 0;
+  }
+  return 1;
 }
 
 // Truncate inode (discard contents).
@@ -372,28 +579,25 @@ static uint bmap(struct inode *ip, uint bn) {
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
+// Frees blocks from the end. A big file takes several
+// transactions, each leaving a shorter but whole file.
 static void itrunc(struct inode *ip) {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for (i = 0; i < NDIRECT; i++) {
-    if (ip->addrs[i]) {
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
-
-  if (ip->addrs[NDIRECT]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
-      if (a[j])
-        bfree(ip->dev, a[j]);
+  struct trunc t;
+  uint bn;
+
+  t.n = 0;
+  bn = (ip->size + BSIZE - 1) / BSIZE;
+  while (bn > 0) {
+    if (bunmap(ip, bn - 1, &t)) {
+      bn--;
+      continue;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    // this transaction is full: commit the shorter file.
+    ip->size = min(ip->size, bn * BSIZE);
+    iupdate(ip);
+    end_op();
+    begin_op();
+    t.n = 0;
   }
 
   ip->size = 0;
@@ -410,6 +614,43 @@ void stati(struct inode *ip, struct stat *st) {
   st->size = ip->size;
 }
 
+#define RAMIN 4  // initial readahead window, in blocks
+#define RAMAX 16 // largest readahead window, in blocks
+
+// Start reading the blocks of [off, off+n) and, if the file is being
+// read sequentially, the next ra->win blocks after them, without
+// waiting. The window doubles for as long as reads stay sequential.
+// readi then finds the blocks cached or on their way.
+// Caller must hold ip->lock.
+void readahead(struct inode *ip, struct readahead *ra, uint off, uint n) {
+  uint first, last, nblk, bn, stop;
+
+  if (ip->type == T_DEV || n == 0 || off >= ip->size)
+    return;
+  if (off + n > ip->size || off + n < off)
+    n = ip->size - off;
+  first = off / BSIZE;
+  last = (off + n - 1) / BSIZE;
+  nblk = (ip->size + BSIZE - 1) / BSIZE;
+
+  // Continuing where the last read left off, or re-reading its
+  // final, partially consumed block?
+  if (first == ra->next || first + 1 == ra->next) {
+    ra->win = ra->win ? min(2 * ra->win, RAMAX) : RAMIN;
+  } else {
+    ra->win = 0;
+    ra->end = 0;
+  }
+  ra->next = last + 1;
+  if (ra->win == 0)
+    return;
+
+  stop = min(last + 1 + ra->win, nblk);
+  for (bn = max(first, ra->end); bn < stop; bn++)
+    breada(ip->dev, bmap(ip, bn));
+  ra->end = max(ra->end, stop);
+}
+
 //  Read data from inode.
 //  Caller must hold ip->lock.
 int readi(struct inode *ip, char *dst, uint off, uint n) {
@@ -454,10 +695,18 @@ int writei(struct inode *ip, const char *src, uint off, uint n) {
     return -1;
 
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
-    bp = bread(ip->dev, bmap(ip, off / BSIZE));
+    // A block at or past the end of the file is new; this
+    // write fills it up to the new end, so don't read it.
+    if (off % BSIZE == 0 && off >= ip->size)
+      bp = bnew(ip->dev, bmap(ip, off / BSIZE));
+    else
+      bp = bread(ip->dev, bmap(ip, off / BSIZE));
     m = min(n - tot, BSIZE - off % BSIZE);
     memmove(bp->data + off % BSIZE, src, m);
-    log_write(bp);
+    if (ip->type == T_FILE)
+      log_writedata(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -0,0 +1,333 @@
+// AHCI (SATA) disk driver.
+// Serves disk 1 from the first SATA disk on the first AHCI controller
+// on PCI; boot with -device ahci,id=ahci -device ide-hd,bus=ahci.0,...
+//
+// With native command queuing the disk takes up to 32 tagged
+// commands at once, one per command slot, and reorders them itself.
+// Without NCQ, commands go one at a time.
+//
+// https://www.intel.com/content/www/us/en/io/serial-ata/serial-ata-ahci-spec-rev1-3-1.html
+// https://wiki.osdev.org/AHCI
+
+#include <xv6/apic.h>
+#include <xv6/bio.h>
+#include <xv6/console.h>
+#include <xv6/kalloc.h>
+#include <xv6/memlayout.h>
+#include <xv6/mmu.h>
+#include <xv6/pci.h>
+#include <xv6/proc.h>
+#include <xv6/spinlock.h>
+#include <xv6/string.h>
+#include <xv6/traptbl.h>
+#include <xv6/types.h>
+#include <xv6/vm.h>
+
+#define SECTOR_SIZE 512
+
+// HBA registers, relative to ABAR (PCI BAR5)
+#define HBA_CAP 0x00 // capabilities
+#define HBA_GHC 0x04 // global host control
+#define HBA_IS  0x08 // interrupt status, a bit per port
+#define HBA_PI  0x0c // ports implemented
+
+#define HBA_CAP_SNCQ (1 << 30) // supports NCQ
+#define HBA_GHC_IE   (1 << 1)  // interrupt enable
+#define HBA_GHC_AE   (1U << 31) // AHCI enable
+
+// Port registers, relative to ABAR + 0x100 + 0x80 * port
+#define PX_CLB  0x00 // command list base (64 bits)
+#define PX_FB   0x08 // received FIS base (64 bits)
+#define PX_IS   0x10 // interrupt status
+#define PX_IE   0x14 // interrupt enable
+#define PX_CMD  0x18 // command and status
+#define PX_TFD  0x20 // task file data
+#define PX_SIG  0x24 // device signature
+#define PX_SSTS 0x28 // SATA status
+#define PX_SERR 0x30 // SATA error
+#define PX_SACT 0x34 // NCQ tags outstanding
+#define PX_CI   0x38 // command slots issued
+
+#define PX_CMD_ST  (1 << 0)  // start processing the command list
+#define PX_CMD_FRE (1 << 4)  // FIS receive enable
+#define PX_CMD_FR  (1 << 14) // FIS receive running
+#define PX_CMD_CR  (1 << 15) // command list running
+#define PX_IS_DHRS (1 << 0)  // device to host register FIS
+#define PX_IS_SDBS (1 << 3)  // set device bits FIS (NCQ completion)
+#define PX_IS_TFES (1 << 30) // task file error
+#define PX_TFD_BSY 0x80
+#define PX_TFD_DRQ 0x08
+#define SIG_ATA    0x00000101
+
+// ATA commands
+#define ATA_IDENTIFY       0xec
+#define ATA_READ_DMA_EXT   0x25
+#define ATA_WRITE_DMA_EXT  0x35
+#define ATA_READ_FPDMA_Q   0x60
+#define ATA_WRITE_FPDMA_Q  0x61
+
+#define NSLOT 32
+
+struct ahci_cmdhdr {
+  ushort flags; // FIS length in dwords, W (bit 6) if writing
+  ushort prdtl; // PRD table entries
+  uint prdbc;   // bytes transferred
+  ulong ctba;   // command table, physical
+  uint rsvd[4];
+};
+
+struct ahci_prd {
+  ulong dba; // data, physical
+  uint rsvd;
+  uint dbc; // byte count - 1
+};
+
+struct ahci_cmdtbl {
+  uchar cfis[64]; // command FIS
+  uchar acmd[16];
+  uchar rsvd[48];
+  struct ahci_prd prd[1];
+} __attribute__((aligned(256)));
+
+static struct ahci_cmdhdr cmdlist[NSLOT] __attribute__((aligned(1024)));
+static uchar rfis[256] __attribute__((aligned(256)));
+static struct ahci_cmdtbl cmdtbl[NSLOT];
+
+static struct spinlock ahcilock;
+static volatile uchar *abar;
+static volatile uchar *port; // registers of our port
+static int nslot;            // slots we use: 32 with NCQ, else 1
+static int ncq;
+static ulong nsect; // disk size
+
+// Protected by ahcilock.
+static struct buf *inflight[NSLOT];
+static uint issued; // slots with a command in them
+static struct buf *waithead, *waittail; // through qnext
+static uint nreq, ninflight, maxinflight;
+
+static uint rd(volatile uchar *base, uint off) {
+  return *(volatile uint *)(base + off);
+}
+
+static void wr(volatile uchar *base, uint off, uint val) {
+  *(volatile uint *)(base + off) = val;
+}
+
+// Fill in slot s for an ATA command on count sectors at lba.
+static void ahcifill(int s, int cmd, ulong lba, int count, void *data,
+                     int len, int write) {
+  struct ahci_cmdtbl *t = &cmdtbl[s];
+  uchar *f = t->cfis;
+
+  memset(f, 0, 20);
+  f[0] = 0x27; // register FIS, host to device
+  f[1] = 0x80; // command, not control
+  f[2] = cmd;
+  f[4] = lba;
+  f[5] = lba >> 8;
+  f[6] = lba >> 16;
+  f[7] = 0x40; // LBA mode
+  f[8] = lba >> 24;
+  f[9] = lba >> 32;
+  f[10] = lba >> 40;
+  if (cmd == ATA_READ_FPDMA_Q || cmd == ATA_WRITE_FPDMA_Q) {
+    // NCQ: count goes in the features field, tag in the count.
+    f[3] = count;
+    f[11] = count >> 8;
+    f[12] = s << 3;
+  } else {
+    f[12] = count;
+    f[13] = count >> 8;
+  }
+  t->prd[0].dba = V2P((ulong)data);
+  t->prd[0].dbc = len - 1;
+
+  cmdlist[s].flags = 5 | (write ? (1 << 6) : 0);
+  cmdlist[s].prdtl = 1;
+  cmdlist[s].prdbc = 0;
+  cmdlist[s].ctba = V2P((ulong)t);
+}
+
+// Ask the disk who it is, by polling slot 0.
+static void ahciidentify(void) {
+  ushort *id;
+
+  if ((id = kalloc()) == 0)
+    panic("ahci: kalloc");
+  ahcifill(0, ATA_IDENTIFY, 0, 0, id, SECTOR_SIZE, 0);
+  wr(port, PX_CI, 1);
+  while (rd(port, PX_CI) & 1)
+    if (rd(port, PX_IS) & PX_IS_TFES)
+      panic("ahci: identify failed");
+  wr(port, PX_IS, rd(port, PX_IS));
+
+  nsect = *(ulong *)&id[100]; // LBA48 sectors
+  ncq = (rd(abar, HBA_CAP) & HBA_CAP_SNCQ) && (id[76] & (1 << 8));
+  nslot = 1;
+  if (ncq) {
+    nslot = (id[75] & 0x1f) + 1; // queue depth
+    if (nslot > ((rd(abar, HBA_CAP) >> 8) & 0x1f) + 1)
+      nslot = ((rd(abar, HBA_CAP) >> 8) & 0x1f) + 1;
+  }
+  kfree(id);
+}
+
+void ideinit(void) {
+  struct pcidev pd;
+  ulong pa;
+  uint pi, cmd;
+  int i, irq;
+
+  initlock(&ahcilock, "ahci");
+  if (!pcifindclass(1, 6, &pd))
+    panic("ahci: no controller");
+  pciwrite(&pd, PCI_CMD,
+           (pciread(&pd, PCI_CMD) & 0xffff) | PCI_CMD_MEM | PCI_CMD_MASTER);
+  pa = pcibar(&pd, 5);
+  kmapdev(pa, 0x1100);
+  abar = (volatile uchar *)P2V(pa);
+  wr(abar, HBA_GHC, rd(abar, HBA_GHC) | HBA_GHC_AE);
+
+  // Find a port with a SATA disk on it.
+  pi = rd(abar, HBA_PI);
+  for (i = 0; i < 32; i++) {
+    if (!(pi & (1U << i)))
+      continue;
+    port = abar + 0x100 + 0x80 * i;
+    if ((rd(port, PX_SSTS) & 0xf) == 3 && rd(port, PX_SIG) == SIG_ATA)
+      break;
+  }
+  if (i == 32)
+    panic("ahci: no disk");
+
+  // Stop the port, hand it our command list and FIS area, restart.
+  cmd = rd(port, PX_CMD) & ~(PX_CMD_ST | PX_CMD_FRE);
+  wr(port, PX_CMD, cmd);
+  while (rd(port, PX_CMD) & (PX_CMD_CR | PX_CMD_FR))
+    ;
+  wr(port, PX_CLB, V2P((ulong)cmdlist));
+  wr(port, PX_CLB + 4, V2P((ulong)cmdlist) >> 32);
+  wr(port, PX_FB, V2P((ulong)rfis));
+  wr(port, PX_FB + 4, V2P((ulong)rfis) >> 32);
+  wr(port, PX_SERR, rd(port, PX_SERR));
+  wr(port, PX_IS, rd(port, PX_IS));
+  wr(port, PX_CMD, cmd | PX_CMD_FRE);
+  while (rd(port, PX_TFD) & (PX_TFD_BSY | PX_TFD_DRQ))
+    ;
+  wr(port, PX_CMD, cmd | PX_CMD_FRE | PX_CMD_ST);
+
+  ahciidentify();
+
+  // Interrupt on command completion and on errors.
+  if (!pcimsienable(&pd, T_IRQ0 + IRQ_IDE, cpus[ncpu - 1].apicid)) {
+    irq = pciread(&pd, PCI_INTR) & 0xff;
+    ioapicroute(irq, T_IRQ0 + IRQ_IDE, ncpu - 1);
+  }
+  wr(port, PX_IE, PX_IS_DHRS | PX_IS_SDBS | PX_IS_TFES);
+  wr(abar, HBA_GHC, rd(abar, HBA_GHC) | HBA_GHC_IE);
+}
+
+// Issue b in free slot s.  Caller must hold ahcilock.
+static void ahcistart(int s, struct buf *b) {
+  ulong lba = (ulong)b->blockno * (BSIZE / SECTOR_SIZE);
+  int write = b->flags & B_DIRTY;
+  int cmd;
+
+  if (ncq)
+    cmd = write ? ATA_WRITE_FPDMA_Q : ATA_READ_FPDMA_Q;
+  else
+    cmd = write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT;
+  ahcifill(s, cmd, lba, BSIZE / SECTOR_SIZE, b->data, BSIZE, write);
+  inflight[s] = b;
+  issued |= 1U << s;
+  if (++ninflight > maxinflight)
+    maxinflight = ninflight;
+
+  __sync_synchronize(); // command before issue
+  if (ncq)
+    wr(port, PX_SACT, 1U << s);
+  wr(port, PX_CI, 1U << s);
+}
+
+// A free slot, or -1.  Caller must hold ahcilock.
+static int ahcislot(void) {
+  int s;
+
+  for (s = 0; s < nslot; s++)
+    if (!(issued & (1U << s)))
+      return s;
+  return -1;
+}
+
+// Interrupt handler.
+void ideintr(void) {
+  struct buf *b;
+  uint is, busy, done;
+  int s;
+
+  acquire(&ahcilock);
+  is = rd(port, PX_IS);
+  wr(port, PX_IS, is);
+  wr(abar, HBA_IS, rd(abar, HBA_IS));
+  if (is & PX_IS_TFES)
+    panic("ahci: disk error");
+
+  // A slot is done once the disk has cleared both its issue bit
+  // and, for NCQ, its tag.
+  busy = rd(port, PX_CI) | rd(port, PX_SACT);
+  done = issued & ~busy;
+  for (s = 0; s < nslot; s++) {
+    if (!(done & (1U << s)))
+      continue;
+    b = inflight[s];
+    inflight[s] = 0;
+    issued &= ~(1U << s);
+    ninflight--;
+    // Mark it done and wake process waiting for this buf.
+    biodone(b);
+  }
+
+  while (waithead && (s = ahcislot()) >= 0) {
+    b = waithead;
+    if ((waithead = b->qnext) == 0)
+      waittail = 0;
+    ahcistart(s, b);
+  }
+  release(&ahcilock);
+}
+
+// The disk is not in memory, so bufs need their own copies.
+uchar *idemap(uint dev, uint blockno) { return 0; }
+
+// Queue buf b for the disk and return without waiting.
+// If B_DIRTY is set, write buf to disk, else read it;
+// ideintr calls biodone when the transfer is over.
+void idesubmit(struct buf *b) {
+  int s;
+
+  if (b->dev != 1)
+    panic("idesubmit: request not for disk 1");
+  if ((ulong)(b->blockno + 1) * (BSIZE / SECTOR_SIZE) > nsect)
+    panic("idesubmit: block out of range");
+
+  acquire(&ahcilock);
+  nreq++;
+  if (waithead == 0 && (s = ahcislot()) >= 0) {
+    ahcistart(s, b);
+  } else {
+    b->qnext = 0;
+    if (waittail)
+      waittail->qnext = b;
+    else
+      waithead = b;
+    waittail = b;
+  }
+  release(&ahcilock);
+}
+
+// Print queue statistics to console. For debugging.
+void idedump(void) {
+  cprintf("ahci: %s, %d reqs, %d in flight (max %d) of %d slots\n",
+          ncq ? "ncq" : "no ncq", nreq, ninflight, maxinflight, nslot);
+}
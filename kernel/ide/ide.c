@@ -1,6 +1,14 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code, for the primary channel of a PIIX-style controller.
+// Transfers use bus-master DMA when the controller is found on PCI,
+// and PIO otherwise. Commands that reach past the first 2^28
+// sectors use the LBA48 forms.
 
+#include <xv6/apic.h>
 #include <xv6/bio.h>
+#include <xv6/console.h>
+#include <xv6/memlayout.h>
+#include <xv6/mmu.h>
+#include <xv6/pci.h>
 #include <xv6/proc.h>
 #include <xv6/spinlock.h>
 #include <xv6/traptbl.h>
@@ -12,20 +20,92 @@
 #define IDE_DF      0x20
 #define IDE_ERR     0x01
 
-#define IDE_CMD_READ  0x20
-#define IDE_CMD_WRITE 0x30
-#define IDE_CMD_RDMUL 0xc4
-#define IDE_CMD_WRMUL 0xc5
+#define IDE_DRQ     0x08
+#define IDE_NIEN    0x02 // in the control register: interrupts off
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+#define IDE_CMD_READ          0x20
+#define IDE_CMD_WRITE         0x30
+#define IDE_CMD_READ_DMA      0xc8
+#define IDE_CMD_WRITE_DMA     0xca
+#define IDE_CMD_READ_EXT      0x24 // LBA48 versions
+#define IDE_CMD_WRITE_EXT     0x34
+#define IDE_CMD_READ_DMA_EXT  0x25
+#define IDE_CMD_WRITE_DMA_EXT 0x35
+#define IDE_CMD_IDENTIFY      0xec
+
+#define IDE_LBA28 0x10000000UL // sectors reachable without LBA48
+
+// Bus-master IDE registers, relative to BMIBA (PCI BAR4).
+// https://wiki.osdev.org/ATA/ATAPI_using_DMA
+#define BM_CMD      0x0 // command
+#define BM_STATUS   0x2 // status
+#define BM_PRDT     0x4 // physical address of the PRD table
+#define BM_CMD_START  0x01 // start transfer
+#define BM_CMD_READ   0x08 // device to memory
+#define BM_STATUS_ERR 0x02 // transfer failed (write 1 to clear)
+#define BM_STATUS_INT 0x04 // device interrupted (write 1 to clear)
+
+// Physical region descriptor: one contiguous piece of a DMA transfer.
+struct prd {
+  uint addr;    // physical address
+  ushort count; // bytes
+  ushort flags; // PRD_EOT on the last entry
+};
+#define PRD_EOT 0x8000
+
+#define IDE_MAXSECT 256 // sectors per command (a count of 0 means 256)
+
+// I/O scheduler.
+// Waiting requests are kept in two queues sorted by (dev, blockno),
+// C-LOOK style: sweep holds blocks at or beyond the head's position,
+// to be served in this pass; nextsweep holds the ones behind it, to
+// be served after wrapping around. Both keep a tail pointer, so the
+// common case of ascending submissions appends in O(1).
+// When the disk goes idle, idestart takes the first request of the
+// sweep along with any following requests for contiguous blocks in
+// the same direction, and issues them as one multi-sector command.
+// You must hold idelock while manipulating the queues.
+
+struct ideq {
+  struct buf *head;
+  struct buf *tail;
+};
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct ideq sweep, nextsweep;
+static uint headdev, headblock; // where the last command ended
+
+// The command in progress: bufs chained through qnext,
+// how many sectors it covers, whether it is using DMA,
+// and (for PIO) how far the transfer has got into the first buf.
+static struct buf *ideactive;
+static int idensect;
+static int idedma;
+static int idesect;
+
+// Bus-master DMA state. bmiba is 0 when DMA is not available.
+// The PRD table must not cross a 64K boundary; a page-aligned
+// table of at most a page can't.
+static ushort bmiba;
+static struct prd prdt[IDE_MAXSECT] __attribute__((aligned(PGSIZE)));
+
+// Per-device statistics, protected by idelock.
+static struct {
+  uint nreq;     // bufs submitted
+  uint ncmd;     // commands issued
+  uint nmerge;   // bufs that rode along in another buf's command
+  uint depth;    // bufs waiting or in flight
+  uint maxdepth; // largest depth seen
+} idestat[2];
 
 static int havedisk1;
-static void idestart(struct buf *);
+
+// What IDENTIFY said about each disk: size in sectors (0 if unknown)
+// and whether it takes LBA48 commands.
+static ulong idesize[2];
+static int idelba48[2];
+static void idecmd(void);
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int idewait(int checkerr) {
@@ -38,6 +118,24 @@ static int idewait(int checkerr) {
   return 0;
 }
 
+// Ask disk dev for its size, polling with interrupts off.
+static void ideidentify(int dev) {
+  ushort id[SECTOR_SIZE / 2];
+
+  outb(0x3f6, IDE_NIEN);
+  outb(0x1f6, 0xe0 | (dev << 4));
+  outb(0x1f7, IDE_CMD_IDENTIFY);
+  if (idewait(1) < 0 || !(inb(0x1f7) & IDE_DRQ))
+    return; // not an ATA disk
+  insl(0x1f0, id, SECTOR_SIZE / 4);
+
+  idelba48[dev] = (id[83] >> 10) & 1;
+  if (idelba48[dev])
+    idesize[dev] = *(ulong *)&id[100];
+  else
+    idesize[dev] = id[60] | ((uint)id[61] << 16);
+}
+
 void ideinit(void) {
   int i;
 
@@ -54,97 +152,263 @@ void ideinit(void) {
     }
   }
 
+  if (havedisk1)
+    ideidentify(1);
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0 << 4));
+
+  // Find the controller for bus-master DMA: class 1 (mass storage),
+  // subclass 1 (IDE), with the bus-master registers in I/O space.
+  struct pcidev pd;
+  if (pcifindclass(1, 1, &pd) && (pciread(&pd, PCI_BAR0 + 16) & 1)) {
+    bmiba = pcibar(&pd, 4);
+    pciwrite(&pd, PCI_CMD,
+             (pciread(&pd, PCI_CMD) & 0xffff) | PCI_CMD_IO | PCI_CMD_MASTER);
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
-static void idestart(struct buf *b) {
-  if (b == 0)
-    panic("idestart");
-  if (b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+// Does a sort before position (dev, blockno)?
+static int idebefore(struct buf *a, uint dev, uint blockno) {
+  return a->dev < dev || (a->dev == dev && a->blockno < blockno);
+}
+
+// Insert b into sorted queue q.
+static void ideqinsert(struct ideq *q, struct buf *b) {
+  struct buf **pp;
+
+  b->qnext = 0;
+  if (q->head == 0) {
+    q->head = q->tail = b;
+  } else if (!idebefore(b, q->tail->dev, q->tail->blockno)) {
+    q->tail->qnext = b;
+    q->tail = b;
+  } else {
+    for (pp = &q->head; !idebefore(b, (*pp)->dev, (*pp)->blockno);
+         pp = &(*pp)->qnext)
+      ;
+    b->qnext = *pp;
+    *pp = b;
+  }
+}
+
+static struct buf *ideqpop(struct ideq *q) {
+  struct buf *b;
+
+  b = q->head;
+  q->head = b->qnext;
+  if (q->head == 0)
+    q->tail = 0;
+  return b;
+}
+
+// Issue the next command: the first request of the sweep plus
+// the contiguous ones after it.  Caller must hold idelock.
+static void idestart(void) {
   int sector_per_block = BSIZE / SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  struct buf *b, *last;
+  int nsect;
 
-  if (sector_per_block > 7)
-    panic("idestart");
+  if (sweep.head == 0) {
+    sweep = nextsweep;
+    nextsweep.head = nextsweep.tail = 0;
+  }
+  if (sweep.head == 0)
+    return;
+
+  b = last = ideqpop(&sweep);
+  nsect = sector_per_block;
+  while (sweep.head && sweep.head->dev == b->dev &&
+         sweep.head->blockno == last->blockno + 1 &&
+         (sweep.head->flags & B_DIRTY) == (b->flags & B_DIRTY) &&
+         nsect + sector_per_block <= IDE_MAXSECT) {
+    last = last->qnext = ideqpop(&sweep);
+    nsect += sector_per_block;
+    idestat[b->dev].nmerge++;
+  }
+  last->qnext = 0;
+  ideactive = b;
+  idensect = nsect;
+  headdev = b->dev;
+  headblock = last->blockno + 1;
+  idestat[b->dev].ncmd++;
+  idecmd();
+}
+
+// Set up a DMA transfer for the active command.
+// Returns 0 if some buffer is out of the controller's 32-bit reach.
+static int idedmasetup(void) {
+  struct buf *b;
+  int i;
+
+  for (i = 0, b = ideactive; b; i++, b = b->qnext) {
+    if (V2P((ulong)b->data) + BSIZE > 0x100000000UL)
+      return 0;
+    prdt[i].addr = V2P((ulong)b->data);
+    prdt[i].count = BSIZE;
+    prdt[i].flags = b->qnext ? 0 : PRD_EOT;
+  }
+  outl(bmiba + BM_PRDT, V2P((ulong)prdt));
+  outb(bmiba + BM_CMD, (ideactive->flags & B_DIRTY) ? 0 : BM_CMD_READ);
+  outb(bmiba + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INT);
+  return 1;
+}
+
+// Issue the active command to the disk.  Caller must hold idelock.
+static void idecmd(void) {
+  struct buf *b = ideactive;
+  ulong sector = (ulong)b->blockno * (BSIZE / SECTOR_SIZE);
+  int write = b->flags & B_DIRTY;
+  int lba48 = sector + idensect > IDE_LBA28;
+
+  idesect = 0;
+  idedma = bmiba && idedmasetup();
 
   idewait(0);
-  outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
+  outb(0x3f6, 0); // generate interrupt
+  if (lba48) {
+    // The high bytes go first, through the same registers.
+    outb(0x1f2, idensect >> 8);
+    outb(0x1f3, (sector >> 24) & 0xff);
+    outb(0x1f4, (sector >> 32) & 0xff);
+    outb(0x1f5, (sector >> 40) & 0xff);
+  }
+  outb(0x1f2, idensect % IDE_MAXSECT); // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
-  if (b->flags & B_DIRTY) {
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+  if (lba48)
+    outb(0x1f6, 0x40 | ((b->dev & 1) << 4));
+  else
+    outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
+  if (idedma) {
+    if (lba48)
+      outb(0x1f7, write ? IDE_CMD_WRITE_DMA_EXT : IDE_CMD_READ_DMA_EXT);
+    else
+      outb(0x1f7, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+    outb(bmiba + BM_CMD, inb(bmiba + BM_CMD) | BM_CMD_START);
+  } else if (write) {
+    outb(0x1f7, lba48 ? IDE_CMD_WRITE_EXT : IDE_CMD_WRITE);
+    outsl(0x1f0, b->data, SECTOR_SIZE / 4);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, lba48 ? IDE_CMD_READ_EXT : IDE_CMD_READ);
   }
 }
 
+// Finish a DMA command: the disk interrupts once, at the end.
+// Caller must hold idelock.
+static void idedmaintr(void) {
+  struct buf *b;
+  int r, st;
+
+  st = inb(bmiba + BM_STATUS);
+  if (!(st & BM_STATUS_INT))
+    return; // not ours
+  outb(bmiba + BM_CMD, 0);
+  r = idewait(1);
+  outb(bmiba + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INT);
+
+  if ((st & BM_STATUS_ERR) || r < 0) {
+    // Give up on DMA and redo the command with PIO.
+    cprintf("ide: dma failed, falling back to pio\n");
+    bmiba = 0;
+    idecmd();
+    return;
+  }
+
+  // Mark them done and wake processes waiting for them.
+  while ((b = ideactive) != 0) {
+    ideactive = b->qnext;
+    idestat[b->dev].depth--;
+    biodone(b);
+  }
+  idestart(); // Start disk on next request in queue.
+}
+
 // Interrupt handler.
+// With PIO the disk interrupts once per sector: after a read sector
+// is ready, or after a written one has been taken.
 void ideintr(void) {
+  int sector_per_block = BSIZE / SECTOR_SIZE;
   struct buf *b;
+  int write;
 
-  // First queued buffer is the active request.
+  // The first active buffer is the one being transferred.
   acquire(&idelock);
 
-  if ((b = idequeue) == 0) {
+  if ((b = ideactive) == 0) {
+    release(&idelock);
+    return;
+  }
+  if (idedma) {
+    idedmaintr();
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
+  write = b->flags & B_DIRTY;
 
   // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE / 4);
+  if (idewait(1) >= 0 && !write)
+    insl(0x1f0, b->data + idesect * SECTOR_SIZE, SECTOR_SIZE / 4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  if (++idesect == sector_per_block) {
+    // Mark it done and wake process waiting for this buf.
+    ideactive = b->qnext;
+    idesect = 0;
+    idestat[b->dev].depth--;
+    biodone(b);
+  }
 
-  // Start disk on next buf in queue.
-  if (idequeue != 0)
-    idestart(idequeue);
+  if (ideactive == 0)
+    idestart(); // Start disk on next request in queue.
+  else if (write)
+    outsl(0x1f0, ideactive->data + idesect * SECTOR_SIZE, SECTOR_SIZE / 4);
 
   release(&idelock);
 }
 
-//  Sync buf with disk.
-//  If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-//  Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b) {
-  struct buf **pp;
+// The disk is not in memory, so bufs need their own copies.
+uchar *idemap(uint dev, uint blockno) { return 0; }
 
-  if (!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+// Queue buf b for the disk and return without waiting.
+// If B_DIRTY is set, write buf to disk, else read it;
+// ideintr calls biodone when the transfer is over.
+void idesubmit(struct buf *b) {
   if (b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    panic("idesubmit: ide disk 1 not present");
+  if (idesize[b->dev] &&
+      (ulong)(b->blockno + 1) * (BSIZE / SECTOR_SIZE) > idesize[b->dev])
+    panic("idesubmit: block out of range");
+  if ((ulong)(b->blockno + 1) * (BSIZE / SECTOR_SIZE) > IDE_LBA28 &&
+      !idelba48[b->dev])
+    panic("idesubmit: disk has no lba48");
 
   acquire(&idelock); // DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for (pp = &idequeue; *pp; pp = &(*pp)->qnext) // DOC:insert-queue
-    ;
-  *pp = b;
+  if (++idestat[b->dev].depth > idestat[b->dev].maxdepth)
+    idestat[b->dev].maxdepth = idestat[b->dev].depth;
+  idestat[b->dev].nreq++;
 
-  // Start disk if necessary.
-  if (idequeue == b)
-    idestart(b);
+  // Serve it in this sweep if the head has yet to pass it.
+  if (idebefore(b, headdev, headblock))
+    ideqinsert(&nextsweep, b);
+  else
+    ideqinsert(&sweep, b);
 
-  // Wait for request to finish.
-  while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID) {
-    sleep(b, &idelock);
-  }
+  // Start disk if necessary.
+  if (ideactive == 0)
+    idestart();
 
   release(&idelock);
 }
+
+// Print queue statistics to console. For debugging.
+void idedump(void) {
+  int dev;
+
+  for (dev = 0; dev < 2; dev++)
+    if (idestat[dev].nreq)
+      cprintf("ide%d: %d reqs, %d cmds, %d merged, depth %d (max %d)\n", dev,
+              idestat[dev].nreq, idestat[dev].ncmd, idestat[dev].nmerge,
+              idestat[dev].depth, idestat[dev].maxdepth);
+}
@@ -1,5 +1,11 @@
 // Fake IDE disk; stores blocks in memory.
 // Useful for running kernel without scratch disk.
+//
+// The buffer cache points its bufs straight at the image (idemap),
+// so reads copy nothing and a write is done the moment the buf
+// changes. That also means a block's home copy changes before the
+// log commits it; memory does not outlive a crash, so no one can
+// tell.
 
 #include <xv6/bio.h>
 #include <xv6/console.h>
@@ -7,7 +13,7 @@
 #include <xv6/string.h>
 #include <xv6/types.h>
 
-static int disksize;
+static uint disksize;
 static uchar *memdisk;
 
 void ideinit(void) {
@@ -15,32 +21,38 @@ void ideinit(void) {
   disksize = (uint)((ulong)_binary_fs_img_size / BSIZE);
 }
 
+// Where block blockno of disk 1 is.
+uchar *idemap(uint dev, uint blockno) {
+  if (dev != 1 || blockno >= disksize)
+    return 0;
+  return memdisk + (ulong)blockno * BSIZE;
+}
+
+// Nothing is ever queued.
+void idedump(void) {}
+
 // Interrupt handler.
 void ideintr(void) {
   // no-op
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b) {
+// Do the transfer for buf b at once; memory never makes us wait.
+// If B_DIRTY is set, write buf to disk, else read it.
+void idesubmit(struct buf *b) {
   uchar *p;
 
-  if (!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
   if (b->dev != 1)
-    panic("iderw: request not for disk 1");
+    panic("idesubmit: request not for disk 1");
   if (b->blockno >= disksize)
-    panic("iderw: block out of range");
+    panic("idesubmit: block out of range");
 
-  p = memdisk + b->blockno * BSIZE;
+  p = memdisk + (ulong)b->blockno * BSIZE;
 
-  if (b->flags & B_DIRTY) {
-    b->flags &= ~B_DIRTY;
+  if (b->data == p)
+    ; // the buf is the block
+  else if (b->flags & B_DIRTY)
     memmove(p, b->data, BSIZE);
-  } else
+  else
     memmove(b->data, p, BSIZE);
-  b->flags |= B_VALID;
+  biodone(b);
 }
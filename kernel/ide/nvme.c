@@ -0,0 +1,349 @@
+// NVMe disk driver.
+// Serves disk 1 from namespace 1 of the first NVMe controller on PCI;
+// boot with -drive file=fs.img,if=none,id=d -device nvme,drive=d,serial=..
+//
+// Each cpu gets its own I/O submission/completion queue pair, with
+// its own lock and, given MSI-X, its own interrupt vector steered back
+// to that cpu, so cpus submitting and completing I/O at the same time
+// don't meet. The admin queue is only used while starting up, by
+// polling.
+//
+// https://nvmexpress.org/specifications/ (NVM Express Base Specification)
+
+#include <xv6/apic.h>
+#include <xv6/bio.h>
+#include <xv6/console.h>
+#include <xv6/kalloc.h>
+#include <xv6/memlayout.h>
+#include <xv6/mmu.h>
+#include <xv6/param.h>
+#include <xv6/pci.h>
+#include <xv6/proc.h>
+#include <xv6/spinlock.h>
+#include <xv6/string.h>
+#include <xv6/traptbl.h>
+#include <xv6/types.h>
+#include <xv6/vm.h>
+
+// Controller registers
+#define NVME_CAP  0x00 // capabilities (64 bits)
+#define NVME_CC   0x14 // controller configuration
+#define NVME_CSTS 0x1c // controller status
+#define NVME_AQA  0x24 // admin queue attributes
+#define NVME_ASQ  0x28 // admin submission queue base (64 bits)
+#define NVME_ACQ  0x30 // admin completion queue base (64 bits)
+#define NVME_DB   0x1000 // doorbells start here
+
+#define NVME_CC_EN     0x1
+#define NVME_CC_IOSQES (6 << 16) // 64-byte submission entries
+#define NVME_CC_IOCQES (4 << 20) // 16-byte completion entries
+#define NVME_CSTS_RDY  0x1
+
+// Opcodes
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+#define NVME_CMD_WRITE       0x01
+#define NVME_CMD_READ        0x02
+
+#define NVQSIZE 64 // entries per queue; NVQSIZE-1 commands in flight
+
+struct nvme_cmd {
+  uint cdw0; // opcode | command id << 16
+  uint nsid;
+  ulong rsvd;
+  ulong mptr;
+  ulong prp1;
+  ulong prp2;
+  uint cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+};
+
+struct nvme_cpl {
+  uint dw0;
+  uint dw1;
+  ushort sqhd;
+  ushort sqid;
+  ushort cid;
+  ushort status; // phase tag in bit 0
+};
+
+// A submission/completion queue pair. Queue 0 is the admin queue;
+// queue i+1 belongs to cpu i.
+struct nvq {
+  struct spinlock lock;
+  int qid;
+  struct nvme_cmd *sq;
+  struct nvme_cpl *cq;
+  volatile uint *sqdb, *cqdb; // doorbells
+  uint sqtail, cqhead;
+  int phase;                     // phase tag of fresh completions
+  struct buf *inflight[NVQSIZE]; // by command id
+  int ninflight;
+  struct buf *waithead, *waittail; // through qnext
+
+  // Statistics, protected by lock.
+  uint nreq, maxinflight;
+};
+
+// Queues must be page aligned; give each its own page.
+static struct nvme_cmd sqmem[NCPU + 1][NVQSIZE]
+    __attribute__((aligned(PGSIZE)));
+static struct nvme_cpl cqmem[NCPU + 1][PGSIZE / sizeof(struct nvme_cpl)]
+    __attribute__((aligned(PGSIZE)));
+
+static struct nvq nvq[NCPU + 1];
+static volatile uchar *regs;
+static uint lbasize;   // bytes per logical block
+static ulong nlba;     // logical blocks in the namespace
+static int percpuintr; // each I/O queue has its own MSI-X vector
+
+static uint nvread(uint off) { return *(volatile uint *)(regs + off); }
+
+static void nvwrite(uint off, uint val) { *(volatile uint *)(regs + off) = val; }
+
+static void nvwrite64(uint off, ulong val) {
+  nvwrite(off, val);
+  nvwrite(off + 4, val >> 32);
+}
+
+static void nvqinit(struct nvq *q, int qid, int dstrd) {
+  initlock(&q->lock, "nvme");
+  q->qid = qid;
+  q->sq = sqmem[qid];
+  q->cq = cqmem[qid];
+  q->sqdb = (volatile uint *)(regs + NVME_DB + (2 * qid) * (4 << dstrd));
+  q->cqdb = (volatile uint *)(regs + NVME_DB + (2 * qid + 1) * (4 << dstrd));
+  q->phase = 1;
+}
+
+// Copy c into the next submission slot of q and ring the doorbell.
+// Caller must hold q->lock, or be alone.
+static void nvpush(struct nvq *q, struct nvme_cmd *c) {
+  q->sq[q->sqtail] = *c;
+  q->sqtail = (q->sqtail + 1) % NVQSIZE;
+  __sync_synchronize(); // command before doorbell
+  *q->sqdb = q->sqtail;
+}
+
+// Next completion of q, or 0 if none has arrived.
+static struct nvme_cpl *nvpeek(struct nvq *q) {
+  struct nvme_cpl *e = &q->cq[q->cqhead];
+
+  if ((*(volatile ushort *)&e->status & 1) != q->phase)
+    return 0;
+  __sync_synchronize(); // phase before the rest of the entry
+  return e;
+}
+
+static void nvpop(struct nvq *q) {
+  if (++q->cqhead == NVQSIZE) {
+    q->cqhead = 0;
+    q->phase ^= 1;
+  }
+}
+
+// Run an admin command to completion, by polling.
+static void nvadmin(struct nvme_cmd *c) {
+  struct nvq *q = &nvq[0];
+  struct nvme_cpl *e;
+
+  nvpush(q, c);
+  while ((e = nvpeek(q)) == 0)
+    ;
+  if (e->status >> 1)
+    panic("nvme: admin command failed");
+  nvpop(q);
+  *q->cqdb = q->cqhead;
+}
+
+void ideinit(void) {
+  struct nvme_cmd c;
+  struct pcidev pd;
+  volatile uint *msix;
+  ulong cap, pa;
+  uchar *id;
+  int i, irq, nvec, dstrd;
+
+  if (!pcifindclass(1, 8, &pd))
+    panic("nvme: no controller");
+  pciwrite(&pd, PCI_CMD,
+           (pciread(&pd, PCI_CMD) & 0xffff) | PCI_CMD_MEM | PCI_CMD_MASTER);
+  pa = pcibar(&pd, 0);
+  kmapdev(pa, 2 * PGSIZE);
+  regs = (volatile uchar *)P2V(pa);
+
+  cap = nvread(NVME_CAP) | ((ulong)nvread(NVME_CAP + 4) << 32);
+  dstrd = (cap >> 32) & 0xf;
+  if ((cap & 0xffff) < NVQSIZE - 1)
+    panic("nvme: queues too small");
+
+  // Reset, point the controller at the admin queue, and enable it.
+  nvwrite(NVME_CC, 0);
+  while (nvread(NVME_CSTS) & NVME_CSTS_RDY)
+    ;
+  for (i = 0; i <= ncpu; i++)
+    nvqinit(&nvq[i], i, dstrd);
+  nvwrite(NVME_AQA, ((NVQSIZE - 1) << 16) | (NVQSIZE - 1));
+  nvwrite64(NVME_ASQ, V2P((ulong)nvq[0].sq));
+  nvwrite64(NVME_ACQ, V2P((ulong)nvq[0].cq));
+  nvwrite(NVME_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+  while (!(nvread(NVME_CSTS) & NVME_CSTS_RDY))
+    ;
+
+  // Identify namespace 1 for its size and block size.
+  if ((id = kalloc()) == 0)
+    panic("nvme: kalloc");
+  memset(&c, 0, sizeof(c));
+  c.cdw0 = NVME_ADMIN_IDENTIFY;
+  c.nsid = 1;
+  c.prp1 = V2P((ulong)id);
+  c.cdw10 = 0; // CNS 0: namespace
+  nvadmin(&c);
+  nlba = *(ulong *)id;
+  lbasize = 1 << ((*(uint *)(id + 128 + 4 * (id[26] & 0xf)) >> 16) & 0xff);
+  kfree(id);
+  if (lbasize > BSIZE || BSIZE % lbasize)
+    panic("nvme: unsupported block size");
+
+  // Steer each cpu's completions back to it if we can; otherwise
+  // all queues share vector 0.
+  msix = pcimsixenable(&pd, &nvec);
+  percpuintr = msix && nvec > ncpu;
+  if (percpuintr) {
+    for (i = 0; i < ncpu; i++)
+      pcimsixroute(msix, i + 1, T_IRQ0 + IRQ_IDE, cpus[i].apicid);
+  } else if (msix) {
+    pcimsixroute(msix, 0, T_IRQ0 + IRQ_IDE, cpus[ncpu - 1].apicid);
+  } else {
+    irq = pciread(&pd, PCI_INTR) & 0xff;
+    ioapicroute(irq, T_IRQ0 + IRQ_IDE, ncpu - 1);
+  }
+
+  // One I/O queue pair per cpu, completion queue first.
+  for (i = 1; i <= ncpu; i++) {
+    memset(&c, 0, sizeof(c));
+    c.cdw0 = NVME_ADMIN_CREATE_CQ;
+    c.prp1 = V2P((ulong)nvq[i].cq);
+    c.cdw10 = ((NVQSIZE - 1) << 16) | i;
+    c.cdw11 = ((percpuintr ? i : 0) << 16) | 0x3; // vector, IEN, PC
+    nvadmin(&c);
+
+    memset(&c, 0, sizeof(c));
+    c.cdw0 = NVME_ADMIN_CREATE_SQ;
+    c.prp1 = V2P((ulong)nvq[i].sq);
+    c.cdw10 = ((NVQSIZE - 1) << 16) | i;
+    c.cdw11 = (i << 16) | 0x1; // completion queue, PC
+    nvadmin(&c);
+  }
+}
+
+// Issue b on q.  Caller must hold q->lock and q must have room.
+static void nvstart(struct nvq *q, struct buf *b) {
+  struct nvme_cmd c;
+  int cid;
+
+  for (cid = 0; q->inflight[cid]; cid++)
+    ;
+  q->inflight[cid] = b;
+  if (++q->ninflight > q->maxinflight)
+    q->maxinflight = q->ninflight;
+
+  // A buf never crosses a page, so one PRP entry covers it.
+  memset(&c, 0, sizeof(c));
+  c.cdw0 = (b->flags & B_DIRTY) ? NVME_CMD_WRITE : NVME_CMD_READ;
+  c.cdw0 |= cid << 16;
+  c.nsid = 1;
+  c.prp1 = V2P((ulong)b->data);
+  c.cdw10 = (ulong)b->blockno * (BSIZE / lbasize);
+  c.cdw11 = ((ulong)b->blockno * (BSIZE / lbasize)) >> 32;
+  c.cdw12 = BSIZE / lbasize - 1; // blocks, 0's based
+  nvpush(q, &c);
+}
+
+// Reap the completions of q and refill it from its waiting list.
+static void nvintr(struct nvq *q) {
+  struct nvme_cpl *e;
+  struct buf *b;
+  int n = 0;
+
+  acquire(&q->lock);
+  while ((e = nvpeek(q)) != 0) {
+    if (e->status >> 1)
+      panic("nvme: i/o failed");
+    b = q->inflight[e->cid];
+    q->inflight[e->cid] = 0;
+    q->ninflight--;
+    nvpop(q);
+    n++;
+    // Mark it done and wake process waiting for this buf.
+    biodone(b);
+  }
+  if (n)
+    *q->cqdb = q->cqhead;
+
+  while (q->waithead && q->ninflight < NVQSIZE - 1) {
+    b = q->waithead;
+    if ((q->waithead = b->qnext) == 0)
+      q->waittail = 0;
+    nvstart(q, b);
+  }
+  release(&q->lock);
+}
+
+// Interrupt handler.
+void ideintr(void) {
+  int i;
+
+  if (percpuintr) {
+    pushcli();
+    i = mycpu() - cpus;
+    popcli();
+    nvintr(&nvq[i + 1]);
+    return;
+  }
+  for (i = 1; i <= ncpu; i++)
+    nvintr(&nvq[i]);
+}
+
+// The disk is not in memory, so bufs need their own copies.
+uchar *idemap(uint dev, uint blockno) { return 0; }
+
+// Queue buf b for the disk and return without waiting.
+// If B_DIRTY is set, write buf to disk, else read it;
+// ideintr calls biodone when the transfer is over.
+void idesubmit(struct buf *b) {
+  struct nvq *q;
+
+  if (b->dev != 1)
+    panic("idesubmit: request not for disk 1");
+  if ((ulong)(b->blockno + 1) * (BSIZE / lbasize) > nlba)
+    panic("idesubmit: block out of range");
+
+  // Use this cpu's queue; holding its lock keeps us here.
+  pushcli();
+  q = &nvq[mycpu() - cpus + 1];
+  acquire(&q->lock);
+  popcli();
+
+  q->nreq++;
+  if (q->ninflight < NVQSIZE - 1) {
+    nvstart(q, b);
+  } else {
+    b->qnext = 0;
+    if (q->waittail)
+      q->waittail->qnext = b;
+    else
+      q->waithead = b;
+    q->waittail = b;
+  }
+  release(&q->lock);
+}
+
+// Print queue statistics to console. For debugging.
+void idedump(void) {
+  int i;
+
+  for (i = 1; i <= ncpu; i++)
+    cprintf("nvme q%d: %d reqs, %d in flight (max %d)\n", i, nvq[i].nreq,
+            nvq[i].ninflight, nvq[i].maxinflight);
+}
@@ -0,0 +1,255 @@
+// Driver for a virtio-blk disk on PCI, through the legacy
+// (virtio 0.9.5) I/O port interface, which QEMU's transitional
+// virtio-blk-pci device provides by default.
+// Serves disk 1; boot with -drive file=fs.img,if=virtio.
+// Unlike IDE, the device takes many requests at once: each buf
+// gets its own request slot, and the rest wait on a queue.
+//
+// https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+// (section 4.1.4.8, "Legacy Interfaces: A Note on PCI Device Layout")
+
+#include <xv6/apic.h>
+#include <xv6/bio.h>
+#include <xv6/console.h>
+#include <xv6/memlayout.h>
+#include <xv6/mmu.h>
+#include <xv6/pci.h>
+#include <xv6/proc.h>
+#include <xv6/spinlock.h>
+#include <xv6/traptbl.h>
+#include <xv6/types.h>
+#include <xv6/x86.h>
+
+#define SECTOR_SIZE 512
+
+#define VIRTIO_VENDOR     0x1af4
+#define VIRTIO_BLK_LEGACY 0x1001
+
+// Legacy register offsets in the I/O BAR
+#define VIRTIO_FEATURES  0x00 // device features
+#define VIRTIO_GFEATURES 0x04 // guest (driver) features
+#define VIRTIO_QPFN      0x08 // queue address, in 4096-byte pages
+#define VIRTIO_QSIZE     0x0c // queue size
+#define VIRTIO_QSEL      0x0e // queue select
+#define VIRTIO_QNOTIFY   0x10 // queue notify
+#define VIRTIO_STATUS    0x12 // device status
+#define VIRTIO_ISR       0x13 // interrupt status; reading clears it
+#define VIRTIO_CAPACITY  0x14 // virtio-blk: size in sectors (64 bits)
+
+// Device status bits
+#define VIRTIO_ACK       1
+#define VIRTIO_DRIVER    2
+#define VIRTIO_DRIVER_OK 4
+
+// Descriptor flags
+#define VRING_NEXT  1 // chained with the next descriptor
+#define VRING_WRITE 2 // device writes (vs reads) the buffer
+
+// Request types and status
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK  0
+
+#define VRING_ALIGN 4096
+#define NQMAX       256 // largest queue we have room for
+#define NVREQ       64  // requests in flight
+
+struct vring_desc {
+  ulong addr; // physical
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vring_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vring_used_elem {
+  uint id; // head of the completed descriptor chain
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;
+  struct vring_used_elem ring[];
+};
+
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  ulong sector;
+};
+
+// The queue must be physically contiguous: descriptors, then the
+// available ring, then the used ring on the next VRING_ALIGN boundary.
+// Kernel bss is, and V2P gives its physical address.
+static char vqmem[3 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static struct spinlock vdlock;
+static ushort iobase;
+static ulong capacity; // sectors
+static int nq;         // queue size, set by the device
+static int nslot;      // request slots in use, 3 descriptors each
+static struct vring_desc *desc;
+static struct vring_avail *avail;
+static struct vring_used *used;
+static ushort usedidx; // next used ring entry to look at
+
+// Request slot i uses descriptors 3i, 3i+1 and 3i+2.
+static struct {
+  struct virtio_blk_req hdr;
+  uchar status;
+  struct buf *b; // 0 if the slot is free
+} slot[NVREQ];
+
+// Bufs waiting for a free slot, through qnext.
+static struct buf *vdqueue, *vdtail;
+
+// Statistics, protected by vdlock.
+static uint nreq, ninflight, maxinflight;
+
+void ideinit(void) {
+  struct pcidev pd;
+  ulong avsize;
+  int i, irq;
+
+  initlock(&vdlock, "virtio");
+  if (!pcifindid(VIRTIO_VENDOR, VIRTIO_BLK_LEGACY, &pd))
+    panic("virtio: no disk");
+  pciwrite(&pd, PCI_CMD,
+           (pciread(&pd, PCI_CMD) & 0xffff) | PCI_CMD_IO | PCI_CMD_MASTER);
+  iobase = pcibar(&pd, 0);
+
+  // Reset, then say hello. We need none of the optional features.
+  outb(iobase + VIRTIO_STATUS, 0);
+  outb(iobase + VIRTIO_STATUS, VIRTIO_ACK);
+  outb(iobase + VIRTIO_STATUS, VIRTIO_ACK | VIRTIO_DRIVER);
+  outl(iobase + VIRTIO_GFEATURES, 0);
+  capacity = inl(iobase + VIRTIO_CAPACITY) |
+             ((ulong)inl(iobase + VIRTIO_CAPACITY + 4) << 32);
+
+  // Lay out queue 0.
+  outw(iobase + VIRTIO_QSEL, 0);
+  nq = inw(iobase + VIRTIO_QSIZE);
+  if (nq == 0 || nq > NQMAX)
+    panic("virtio: queue size");
+  nslot = nq / 3 < NVREQ ? nq / 3 : NVREQ;
+  desc = (struct vring_desc *)vqmem;
+  avail = (struct vring_avail *)(vqmem + nq * sizeof(struct vring_desc));
+  avsize = nq * sizeof(struct vring_desc) + 6 + 2 * nq;
+  used = (struct vring_used *)(vqmem + PGROUNDUP(avsize));
+  for (i = 0; i < nslot; i++) {
+    desc[3 * i].addr = V2P((ulong)&slot[i].hdr);
+    desc[3 * i].len = sizeof(slot[i].hdr);
+    desc[3 * i].flags = VRING_NEXT;
+    desc[3 * i].next = 3 * i + 1;
+    desc[3 * i + 1].len = BSIZE;
+    desc[3 * i + 1].next = 3 * i + 2;
+    desc[3 * i + 2].addr = V2P((ulong)&slot[i].status);
+    desc[3 * i + 2].len = 1;
+    desc[3 * i + 2].flags = VRING_WRITE;
+  }
+  outl(iobase + VIRTIO_QPFN, V2P((ulong)vqmem) / VRING_ALIGN);
+
+  outb(iobase + VIRTIO_STATUS, VIRTIO_ACK | VIRTIO_DRIVER | VIRTIO_DRIVER_OK);
+
+  // Deliver the device's interrupts where trap() expects the disk's.
+  irq = pciread(&pd, PCI_INTR) & 0xff;
+  ioapicroute(irq, T_IRQ0 + IRQ_IDE, ncpu - 1);
+}
+
+// Put b in request slot i and hand it to the device.
+// Caller must hold vdlock.
+static void vdstart(int i, struct buf *b) {
+  int head = 3 * i;
+
+  slot[i].b = b;
+  slot[i].status = 0xff;
+  slot[i].hdr.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  slot[i].hdr.reserved = 0;
+  slot[i].hdr.sector = (ulong)b->blockno * (BSIZE / SECTOR_SIZE);
+  desc[head + 1].addr = V2P((ulong)b->data);
+  desc[head + 1].flags = VRING_NEXT | ((b->flags & B_DIRTY) ? 0 : VRING_WRITE);
+
+  avail->ring[avail->idx % nq] = head;
+  __sync_synchronize(); // ring entry before index
+  avail->idx++;
+  __sync_synchronize(); // index before notify
+  outw(iobase + VIRTIO_QNOTIFY, 0);
+
+  if (++ninflight > maxinflight)
+    maxinflight = ninflight;
+}
+
+// Interrupt handler.
+void ideintr(void) {
+  struct buf *b;
+  int i;
+
+  acquire(&vdlock);
+  inb(iobase + VIRTIO_ISR); // acknowledge
+
+  while (usedidx != *(volatile ushort *)&used->idx) {
+    __sync_synchronize(); // index before ring entry
+    i = used->ring[usedidx % nq].id / 3;
+    usedidx++;
+    b = slot[i].b;
+    if (slot[i].status != VIRTIO_BLK_S_OK)
+      panic("virtio: request failed");
+    ninflight--;
+
+    // Mark it done and wake process waiting for this buf,
+    // then give the slot to the next waiting buf, if any.
+    biodone(b);
+    slot[i].b = 0;
+    if ((b = vdqueue) != 0) {
+      if ((vdqueue = b->qnext) == 0)
+        vdtail = 0;
+      vdstart(i, b);
+    }
+  }
+
+  release(&vdlock);
+}
+
+// The disk is not in memory, so bufs need their own copies.
+uchar *idemap(uint dev, uint blockno) { return 0; }
+
+// Queue buf b for the disk and return without waiting.
+// If B_DIRTY is set, write buf to disk, else read it;
+// ideintr calls biodone when the transfer is over.
+void idesubmit(struct buf *b) {
+  int i;
+
+  if (b->dev != 1)
+    panic("idesubmit: request not for disk 1");
+  if ((ulong)(b->blockno + 1) * (BSIZE / SECTOR_SIZE) > capacity)
+    panic("idesubmit: block out of range");
+
+  acquire(&vdlock);
+  nreq++;
+  for (i = 0; i < nslot; i++)
+    if (slot[i].b == 0)
+      break;
+  if (i < nslot) {
+    vdstart(i, b);
+  } else {
+    b->qnext = 0;
+    if (vdtail)
+      vdtail->qnext = b;
+    else
+      vdqueue = b;
+    vdtail = b;
+  }
+  release(&vdlock);
+}
+
+// Print queue statistics to console. For debugging.
+void idedump(void) {
+  cprintf("virtio: %d reqs, %d in flight (max %d) of %d slots\n", nreq,
+          ninflight, maxinflight, nslot);
+}
@@ -54,3 +54,11 @@ void ioapicenable(int irq, int cpunum) {
   ioapicwrite(REG_TABLE + 2 * irq, T_IRQ0 + irq);
   ioapicwrite(REG_TABLE + 2 * irq + 1, cpunum << 24);
 }
+
+// Route a PCI interrupt line to the given vector on cpunum.
+// PCI lines are shared and level-triggered; QEMU wires them
+// active high.
+void ioapicroute(int irq, int vector, int cpunum) {
+  ioapicwrite(REG_TABLE + 2 * irq, INT_LEVEL | vector);
+  ioapicwrite(REG_TABLE + 2 * irq + 1, cpunum << 24);
+}
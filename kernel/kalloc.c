@@ -2,6 +2,7 @@
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
 
+#include <xv6/bio.h>
 #include <xv6/console.h>
 #include <xv6/kalloc.h>
 #include <xv6/memlayout.h>
@@ -21,6 +22,7 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree; // pages on freelist
 } kmem;
 
 struct kmap kmap[KMAP_MAX_SIZE];
@@ -74,6 +76,7 @@ void kfree(void *va) {
   r = (struct run *)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if (kmem.use_lock)
     release(&kmem.lock);
 }
@@ -81,15 +84,23 @@ void kfree(void *va) {
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When memory runs out, asks the buffer cache to give some back.
 void *kalloc(void) {
   struct run *r;
 
-  if (kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r)
-    kmem.freelist = r->next;
-  if (kmem.use_lock)
-    release(&kmem.lock);
+  do {
+    if (kmem.use_lock)
+      acquire(&kmem.lock);
+    r = kmem.freelist;
+    if (r) {
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    if (kmem.use_lock)
+      release(&kmem.lock);
+  } while (r == 0 && bshrink());
   return (void *)r;
 }
+
+// Number of free pages. Unlocked, so only a hint.
+int kfreepages(void) { return kmem.nfree; }
@@ -9,11 +9,31 @@ KERN_OBJS := $(patsubst %.c, %.o,\
 
 KERN_OBJS_IDEFS := $(KERN_OBJS) kernel/ide/ide.o
 KERN_OBJS_MEMFS := $(KERN_OBJS) kernel/ide/memide.o
+KERN_OBJS_VIRTIO := $(KERN_OBJS) kernel/ide/virtio.o
+KERN_OBJS_NVME := $(KERN_OBJS) kernel/ide/nvme.o
+KERN_OBJS_AHCI := $(KERN_OBJS) kernel/ide/ahci.o
+
+# The FPU/SIMD registers belong to user processes (see fpu.c),
+# so the kernel must not let the compiler use them.
+KERN_OBJS_DRIVERS := $(addprefix kernel/ide/, ide.o memide.o virtio.o nvme.o ahci.o)
+$(KERN_OBJS) $(KERN_OBJS_DRIVERS): CFLAGS += -mno-mmx -mno-sse -mno-sse2
 
 kernel.elf: $(KERN_OBJS_IDEFS) kernel/bin/initcode kernel/bin/entryother kernel/kernel.ld
 	$(LD) $(LDFLAGS) -T kernel/kernel.ld -o $@ $(KERN_OBJS_IDEFS) \
 		-b binary kernel/bin/initcode kernel/bin/entryother kernel/bin/zap-light16.psf
 
+kernelv.elf: $(KERN_OBJS_VIRTIO) kernel/bin/initcode kernel/bin/entryother kernel/kernel.ld
+	$(LD) $(LDFLAGS) -T kernel/kernel.ld -o $@ $(KERN_OBJS_VIRTIO) \
+		-b binary kernel/bin/initcode kernel/bin/entryother kernel/bin/zap-light16.psf
+
+kerneln.elf: $(KERN_OBJS_NVME) kernel/bin/initcode kernel/bin/entryother kernel/kernel.ld
+	$(LD) $(LDFLAGS) -T kernel/kernel.ld -o $@ $(KERN_OBJS_NVME) \
+		-b binary kernel/bin/initcode kernel/bin/entryother kernel/bin/zap-light16.psf
+
+kernela.elf: $(KERN_OBJS_AHCI) kernel/bin/initcode kernel/bin/entryother kernel/kernel.ld
+	$(LD) $(LDFLAGS) -T kernel/kernel.ld -o $@ $(KERN_OBJS_AHCI) \
+		-b binary kernel/bin/initcode kernel/bin/entryother kernel/bin/zap-light16.psf
+
 kernelm.elf: $(KERN_OBJS_MEMFS) kernel/bin/initcode kernel/bin/entryother kernel/kernel.ld fs.img
 	$(LD) $(LDFLAGS) -T kernel/kernel.ld -o $@ $(KERN_OBJS_MEMFS) \
 		-b binary kernel/bin/initcode kernel/bin/entryother kernel/bin/zap-light16.psf fs.img
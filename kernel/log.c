@@ -1,192 +1,587 @@
 #include <xv6/bio.h>
 #include <xv6/console.h>
 #include <xv6/fs.h>
+#include <xv6/ide.h>
+#include <xv6/kalloc.h>
+#include <xv6/log.h>
+#include <xv6/mmu.h>
 #include <xv6/param.h>
 #include <xv6/proc.h>
 #include <xv6/spinlock.h>
 #include <xv6/string.h>
+#include <xv6/trap.h>
 #include <xv6/types.h>
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction stops taking new operations ("closes") when
+// it might run out of log space or has been open for COMMITTICKS,
+// and is frozen when its last operation ends: its blocks are
+// copied aside, and a new transaction opens at once. Thus there is
+// never any reasoning required about whether a commit might write
+// an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves
+// MAXOPBLOCKS of log space for the call and returns; calls
+// that need more (filewrite) use begin_opn()/end_opn().
+// But if the running transaction is closing, it sleeps until
+// the last outstanding end_op() freezes it.
+//
+// The committer kernel thread takes frozen transactions in order:
+// it writes each one's copies to the log, writes the header (the
+// commit), and installs the copies at their home locations, while
+// new operations go on changing the cached blocks. Whatever
+// operations end while one transaction is being committed are
+// batched into the next (group commit). The last operation of a
+// transaction waits in end_op until it is committed.
+//
+// On an FS_DELAYED file system the last end_op() neither freezes
+// the transaction nor waits: it stays open until the flusher thread
+// finds it DELAYTICKS old, the log fills up, or fsync()/sync() calls
+// log_sync(). Many small operations then share one commit.
+//
+// Up to NTRANS transactions can be frozen at once; after that,
+// freezing waits for the committer, and new operations wait for
+// the freeze, so the dirty set stays bounded.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk log format (sb.nlog blocks, see LOGHEAD in fs.h):
+//   header blocks, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header and the logged blocks go to disk together, as one run
+// of contiguous blocks. The header holds a checksum of the logged
+// blocks, so recovery can tell whether all of them got there; if so,
+// the transaction is committed.
+//
+// On an FS_ORDERED file system, file data is not logged:
+// log_writedata() adds the block to the transaction's data list,
+// and the committer writes it home, from the frozen copy, before
+// the commit. A crash may then leave new data in a file whose
+// metadata is old, but never a file pointing at garbage.
+// A block freed by a transaction that is not yet durable may still
+// belong to its old file after a crash, so data written to such
+// a block is logged after all (see log_free).
+
+#define COMMITTICKS 10 // ticks a transaction takes new operations for
+#define DELAYTICKS  100 // the same, on an FS_DELAYED file system
+#define NFREED      1024 // recently freed blocks remembered
+#define NINDEX      4096 // index slots per transaction, > 2 * LOGMAX
 
-// Contents of the header block, used for both the on-disk header block
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
+// Exactly 2 blocks long, so it can be written a block at a time.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint sum; // see logsum()
+  int block[LOGMAX];
+};
+
+// A transaction that takes no more operations, with copies of
+// its blocks as they were when it was frozen.
+struct trans {
+  // Page-aligned, so no header block crosses a page.
+  struct logheader lh __attribute__((aligned(PGSIZE)));
+  int frozen; // waiting for or in the hands of the committer
+  uint seq;
+  int ndata;
+  int data[LOGMAX];    // unlogged data blocks
+  uchar *copy[LOGMAX]; // contents of lh.block[i], then of data[i];
+                       // kalloc'd by freeze(), freed once installed
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int nhead;       // header blocks
+  int size;        // blocks the log can hold after the header
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log space they have reserved.
+  int closing;     // running transaction takes no new ops.
+  int freezing;    // freeze() is under way.
+  uint opened;     // ticks when the running transaction got its first op.
+  uint seq;        // sequence number of the running transaction.
+  uint durable;    // last sequence number committed to disk.
+  int next;        // trans[] slot for the running transaction.
   int dev;
-  struct logheader lh;
+  int ordered;     // FS_ORDERED: file data is not logged.
+  int delayed;     // FS_DELAYED: ops don't wait for the commit.
+  uint maxage;     // ticks before the running transaction closes.
+  uint alldata;    // log file data anyway until this seq is durable.
+  struct logheader lh; // the running transaction
+  int ndata;           // its unlogged data blocks
+  int data[LOGMAX];
 };
 struct log log;
 
+static struct trans trans[NTRANS];
+
+// Blocks freed by transactions that may not be durable yet, with the
+// freeing transaction's seq: an open-addressed hash table. Entries
+// with seq <= log.durable are stale, and dropped when it fills up.
+struct freed {
+  uint blockno;
+  uint seq;
+};
+static struct freed freed[NFREED], oldfreed[NFREED];
+static int nfreed;
+
+// Where each block of a transaction is, so log_write() absorbs in
+// constant time: an open-addressed hash table for each transaction
+// that can be live at once, used by the one whose seq it is. A slot
+// whose seq is not the transaction's own is free; so a new
+// transaction starts with an empty table without clearing it.
+struct slot {
+  uint blockno;
+  uint seq;
+  int i; // lh.block[i], or data[i - LOGMAX]
+};
+static struct slot tindex[NTRANS + 1][NINDEX];
+
+// Private bufs through which the committer writes the copies,
+// leaving the cached blocks alone: a logged block or a header
+// block each.
+static struct buf wbuf[LOGMAX + 2];
+
+// The committer's scratch space for write_log and install_trans;
+// too big for its stack.
+static uint wblockno[LOGMAX + 2];
+static uchar *wdata[LOGMAX + 2];
+
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
+static void flusher(void);
+static int freezeidle(void);
 
 void initlog(int dev) {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  int i;
+
+  if (sizeof(struct logheader) != 2 * BSIZE)
+    panic("initlog: logheader size");
 
   struct superblock sb;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
-  log.size = sb.nlog;
+  log.nhead = LOGHEAD(sb.nlog);
+  log.size = sb.nlog - log.nhead;
+  if (log.size < MAXOPBLOCKS || log.size > LOGMAX || log.nhead > 2)
+    panic("initlog: bad log size");
   log.dev = dev;
+  log.ordered = (sb.flags & FS_ORDERED) != 0;
+  log.delayed = (sb.flags & FS_DELAYED) != 0;
+  log.maxage = log.delayed ? DELAYTICKS : COMMITTICKS;
+  log.seq = 1;
+  for (i = 0; i < LOGMAX + 2; i++)
+    initsleeplock(&wbuf[i].lock, "wbuf");
   recover_from_log();
+  // A log made by an older mkfs may be bigger than the cache can
+  // pin; use only part of it.
+  if (log.size > LOGBLOCKS)
+    log.size = LOGBLOCKS;
+  kthreadcreate(committer, "committer");
+  if (log.delayed)
+    kthreadcreate(flusher, "flusher");
 }
 
-// Copy committed blocks from log to their home location
-static void install_trans(void) {
-  int tail;
+// Write data[i] to block blockno[i] for i < n,
+// with all the writes in flight at once.
+static void write_blocks(uint *blockno, uchar **data, int n) {
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start + tail + 1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]);   // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
-    bwrite(dbuf);                           // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  for (i = 0; i < n; i++) {
+    acquiresleep(&wbuf[i].lock);
+    wbuf[i].dev = log.dev;
+    wbuf[i].blockno = blockno[i];
+    wbuf[i].data = data[i];
+    wbuf[i].flags = B_VALID | B_DIRTY;
+    bsubmit(&wbuf[i]);
+  }
+  for (i = 0; i < n; i++) {
+    bwait(&wbuf[i]);
+    releasesleep(&wbuf[i].lock);
+  }
+}
+
+// Copy t's blocks to their home locations, in ascending order.
+// Blocks the driver keeps in memory are skipped: the cached copy is
+// the home copy, and may be newer than t's.
+static void install_trans(struct trans *t) {
+  int i, j, n = 0;
+
+  for (i = 0; i < t->lh.n; i++) {
+    if (idemap(log.dev, t->lh.block[i]))
+      continue;
+    for (j = n; j > 0 && wblockno[j - 1] > t->lh.block[i]; j--) {
+      wblockno[j] = wblockno[j - 1];
+      wdata[j] = wdata[j - 1];
+    }
+    wblockno[j] = t->lh.block[i];
+    wdata[j] = t->copy[i];
+    n++;
   }
+  write_blocks(wblockno, wdata, n);
+}
+
+// The slot for blockno in the index of transaction seq: the one
+// holding it, or the free one where it would go.
+static struct slot *findslot(uint seq, uint blockno) {
+  struct slot *tab = tindex[seq % (NTRANS + 1)];
+  uint h;
+
+  for (h = blockno % NINDEX; tab[h].seq == seq; h = (h + 1) % NINDEX)
+    if (tab[h].blockno == blockno)
+      break;
+  return &tab[h];
+}
+
+// Is blockno logged by the running transaction,
+// or by a frozen one other than t?  Caller holds log.lock.
+static int logged(uint blockno, struct trans *t) {
+  struct trans *u;
+
+  if (findslot(log.seq, blockno)->seq == log.seq)
+    return 1;
+  for (u = trans; u < trans + NTRANS; u++)
+    if (u != t && u->frozen && findslot(u->seq, blockno)->seq == u->seq)
+      return 1;
+  return 0;
+}
+
+// t's blocks are at home now, so the cache may evict them,
+// unless a later transaction has logged them again.
+static void unpin(struct trans *t) {
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < t->lh.n + t->ndata; i++) {
+    if (i < t->lh.n)
+      b = bread(log.dev, t->lh.block[i]);
+    else
+      b = bread(log.dev, t->data[i - t->lh.n]);
+    acquire(&log.lock);
+    if (!logged(b->blockno, t))
+      b->flags &= ~B_DIRTY;
+    release(&log.lock);
+    brelse(b);
+  }
+}
+
+// Header blocks in use for a transaction of n blocks.
+static int headblocks(int n) {
+  return ((n + 2) * sizeof(int) + BSIZE - 1) / BSIZE;
 }
 
 // Read the log header from disk into the in-memory log header
 static void read_head(void) {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *)(buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf *buf;
+  int k;
+
+  for (k = 0; k < log.nhead; k++) {
+    buf = bread(log.dev, log.start + k);
+    memmove((uchar *)&log.lh + k * BSIZE, buf->data, BSIZE);
+    brelse(buf);
+    if (k == 0 && (log.lh.n < 0 || log.lh.n > log.size))
+      panic("read_head: bad log header");
+    if (k + 1 == headblocks(log.lh.n))
+      break;
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void write_head(void) {
+// Add n bytes at p to checksum sum (32-bit FNV-1a, a word at a time).
+static uint addsum(uint sum, void *p, int n) {
+  uint *w = p;
+
+  for (; n > 0; n -= sizeof(uint))
+    sum = (sum ^ *w++) * 16777619;
+  return sum;
+}
+
+// Checksum of a header's block numbers and the contents of the
+// logged blocks, as far as they have been added.
+#define SUMSTART(lh) addsum(2166136261, (lh)->block, (lh)->n * sizeof(int))
+
+// Write the first block of log header lh to disk, when it has no
+// blocks: clearing the log.
+static void write_head(struct logheader *lh) {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *)(buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  memmove(buf->data, lh, BSIZE);
   bwrite(buf);
   brelse(buf);
 }
 
 static void recover_from_log(void) {
+  uint sum;
+  int tail;
+
   read_head();
-  install_trans(); // if committed, copy from log to disk
+  // committed if all the blocks reached the log
+  sum = SUMSTART(&log.lh);
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, log.start + log.nhead + tail);
+    sum = addsum(sum, lbuf->data, BSIZE);
+    brelse(lbuf);
+  }
+  if (log.lh.n > 0 && sum != log.lh.sum) {
+    cprintf("log: discarding an incomplete transaction\n");
+    log.lh.n = 0;
+  }
+  // if committed, copy from log to disk
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, log.start + log.nhead + tail); // log block
+    struct buf *dbuf = bread(log.dev, log.lh.block[tail]);   // read dst
+    memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
+    bwrite(dbuf);                           // write dst to disk
+    brelse(lbuf);
+    brelse(dbuf);
+  }
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh); // clear the log
 }
 
 // called at the start of each FS system call.
-void begin_op(void) {
+void begin_op(void) { begin_opn(MAXOPBLOCKS); }
+
+// Most blocks one begin_opn() may reserve: enough for a few big
+// writes to share a transaction.
+int log_maxop(void) {
+  return log.size / 4 > MAXOPBLOCKS ? log.size / 4 : MAXOPBLOCKS;
+}
+
+// called at the start of an FS system call
+// that may log up to n blocks.
+void begin_opn(int n) {
+  if (n > log_maxop())
+    panic("begin_opn: too many blocks");
+
   acquire(&log.lock);
   while (1) {
-    if (log.committing) {
-      sleep(&log, &log.lock);
-    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
-      // this op might exhaust log space; wait for commit.
+    if (log.closing) {
+      if (!freezeidle())
+        sleep(&log, &log.lock);
+    } else if (log.lh.n + log.ndata + log.reserved + n > log.size) {
+      // this op might exhaust log space; close the transaction.
+      log.closing = 1;
+      if (!freezeidle())
+        sleep(&log, &log.lock);
+    } else if (log.outstanding > 0 && ticks - log.opened >= log.maxage) {
+      // don't let a steady stream of ops defer the commit forever.
+      log.closing = 1;
       sleep(&log, &log.lock);
     } else {
+      if (log.outstanding == 0 && log.lh.n + log.ndata == 0)
+        log.opened = ticks;
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// Hand the running transaction to the committer and open a new one.
+// Caller holds log.lock, has set log.closing, and has checked that
+// no ops are outstanding, so nobody changes the blocks meanwhile.
+// Returns the frozen transaction's sequence number.
+static uint freeze(void) {
+  struct trans *t = &trans[log.next];
+  struct buf *b;
+  int i;
+
+  log.freezing = 1;
+  while (t->frozen)
+    sleep(&log, &log.lock); // the committer is NTRANS behind
+  release(&log.lock);
+
+  // A page per block, only for as long as the transaction is in
+  // flight: an idle log holds no memory.
+  for (i = 0; i < log.lh.n + log.ndata; i++)
+    if ((t->copy[i] = kalloc()) == 0)
+      panic("freeze: out of memory");
+  for (i = 0; i < log.lh.n; i++) {
+    b = bread(log.dev, log.lh.block[i]); // pinned, so cached
+    memmove(t->copy[i], b->data, BSIZE);
+    brelse(b);
+  }
+  for (i = 0; i < log.ndata; i++) {
+    b = bread(log.dev, log.data[i]);
+    memmove(t->copy[log.lh.n + i], b->data, BSIZE);
+    brelse(b);
+  }
+
+  acquire(&log.lock);
+  t->lh = log.lh;
+  t->ndata = log.ndata;
+  memmove(t->data, log.data, log.ndata * sizeof(int));
+  t->seq = log.seq++;
+  t->frozen = 1;
+  wakeup(t);
+  log.next = (log.next + 1) % NTRANS;
+  log.lh.n = 0;
+  log.ndata = 0;
+  log.closing = 0;
+  log.freezing = 0;
+  wakeup(&log);
+  return t->seq;
+}
+
+// Freeze the closing transaction if no end_op() will: on an
+// FS_DELAYED file system it can have blocks but no ops in flight.
+// Returns 1 if it froze. Caller holds log.lock.
+static int freezeidle(void) {
+  if (!log.closing || log.freezing || log.outstanding > 0 ||
+      log.lh.n + log.ndata == 0)
+    return 0;
+  freeze();
+  return 1;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
-void end_op(void) {
-  int do_commit = 0;
+// freezes the transaction if this was the last outstanding
+// operation, and waits for it to commit; on an FS_DELAYED
+// file system, only if the transaction is closing, without waiting.
+void end_op(void) { end_opn(MAXOPBLOCKS); }
+
+// end_op() for begin_opn(n).
+void end_opn(int n) {
+  uint seq;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if (log.committing)
-    panic("log.committing");
-  if (log.outstanding == 0) {
-    do_commit = 1;
-    log.committing = 1;
+  log.reserved -= n;
+  if (log.outstanding == 0 && log.lh.n + log.ndata > 0 &&
+      (!log.delayed || log.closing)) {
+    log.closing = 1;
+    seq = freeze();
+    while (!log.delayed && log.durable < seq)
+      sleep(&log.durable, &log.lock);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
+    if (log.outstanding == 0)
+      log.closing = 0;
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// Wait until every operation that has ended is durable:
+// close the running transaction, if it has blocks, and wait for it
+// to commit. For fsync() and sync().
+void log_sync(void) {
+  uint seq;
+
+  acquire(&log.lock);
+  if (log.lh.n + log.ndata == 0) {
+    seq = log.seq - 1; // the last frozen transaction
+  } else {
+    seq = log.seq;
+    // if ops are in flight, the last end_op() freezes it.
+    log.closing = 1;
+    freezeidle();
+  }
+  while (log.durable < seq)
+    sleep(&log.durable, &log.lock);
+  release(&log.lock);
+}
+
+// Kernel thread that closes the running transaction once it is
+// log.maxage ticks old, on an FS_DELAYED file system.
+static void flusher(void) {
+  uint t0;
+
+  for (;;) {
+    acquire(&tickslock);
+    t0 = ticks;
+    while (ticks - t0 < DELAYTICKS / 10)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    if (log.lh.n + log.ndata > 0 && ticks - log.opened >= log.maxage)
+      log.closing = 1;
+    freezeidle();
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void write_log(void) {
-  int tail;
+// Write t's data blocks home, then the header and t's copies to
+// the log: the true point at which the transaction commits. The
+// header goes out with the copies, in one run of blocks from
+// log.start; its checksum shows whether they all got to disk.
+static void write_log(struct trans *t) {
+  int n = 0, i, k, tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start + tail + 1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to); // write the log
-    brelse(from);
-    brelse(to);
+  // data first: the commit must not land before it.
+  for (i = 0; i < t->ndata; i++) {
+    if (idemap(log.dev, t->data[i]))
+      continue; // already home, as in install_trans
+    wblockno[n] = t->data[i];
+    wdata[n++] = t->copy[t->lh.n + i];
   }
+  if (n > 0)
+    write_blocks(wblockno, wdata, n);
+
+  t->lh.sum = SUMSTART(&t->lh);
+  for (tail = 0; tail < t->lh.n; tail++)
+    t->lh.sum = addsum(t->lh.sum, t->copy[tail], BSIZE);
+  // all the header blocks, even unused ones, so the run has no gaps.
+  n = 0;
+  for (k = 0; k < log.nhead; k++) {
+    wblockno[n] = log.start + k;
+    wdata[n++] = (uchar *)&t->lh + k * BSIZE;
+  }
+  for (tail = 0; tail < t->lh.n; tail++) {
+    wblockno[n] = log.start + log.nhead + tail;
+    wdata[n++] = t->copy[tail];
+  }
+  write_blocks(wblockno, wdata, n);
 }
 
-static void commit(void) {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head(); // Erase the transaction from the log
+// Kernel thread that commits and installs frozen transactions,
+// in the order they were frozen.
+static void committer(void) {
+  struct trans *t;
+  int i, k = 0;
+
+  for (;;) {
+    t = &trans[k];
+    acquire(&log.lock);
+    while (!t->frozen)
+      sleep(t, &log.lock);
+    release(&log.lock);
+
+    write_log(t); // Write data home, then header and blocks to log
+
+    acquire(&log.lock);
+    log.durable = t->seq;
+    wakeup(&log.durable);
+    release(&log.lock);
+
+    install_trans(t); // Now install writes to home locations
+    unpin(t);
+    for (i = 0; i < t->lh.n + t->ndata; i++)
+      kfree(t->copy[i]);
+    t->lh.n = 0;
+    t->ndata = 0;
+    write_head(&t->lh); // Erase the transaction from the log
+
+    acquire(&log.lock);
+    t->frozen = 0;
+    wakeup(&log);
+    release(&log.lock);
+    k = (k + 1) % NTRANS;
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// The committer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -194,21 +589,113 @@ static void commit(void) {
 //   log_write(bp)
 //   brelse(bp)
 void log_write(struct buf *b) {
-  int i;
+  struct slot *s;
+  int j;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n + log.ndata >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno) // log absorbtion
-      break;
+  s = findslot(log.seq, b->blockno);
+  if (s->seq == log.seq && s->i >= LOGMAX) {
+    // a data block that became metadata: log it instead.
+    j = s->i - LOGMAX;
+    if (j != --log.ndata) {
+      log.data[j] = log.data[log.ndata];
+      findslot(log.seq, log.data[j])->i = LOGMAX + j;
+    }
+    s->i = log.lh.n;
+    log.lh.block[log.lh.n++] = b->blockno;
+  } else if (s->seq != log.seq) {
+    s->blockno = b->blockno;
+    s->seq = log.seq;
+    s->i = log.lh.n;
+    log.lh.block[log.lh.n++] = b->blockno;
+  } // else log absorbtion
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&log.lock);
+}
+
+// Was blockno freed by a transaction that is not durable yet?
+// Caller holds log.lock.
+static int freedrecently(uint blockno) {
+  int i;
+
+  for (i = blockno % NFREED; freed[i].blockno != 0; i = (i + 1) % NFREED)
+    if (freed[i].blockno == blockno)
+      return freed[i].seq > log.durable;
+  return 0;
+}
+
+// Like log_write(), for a block of file data. On an ordered file
+// system the block is written home before the commit, not logged.
+void log_writedata(struct buf *b) {
+  struct slot *s;
+
+  if (!log.ordered) {
+    log_write(b);
+    return;
+  }
+  if (log.lh.n + log.ndata >= log.size)
+    panic("too big a transaction");
+  if (log.outstanding < 1)
+    panic("log_writedata outside of trans");
+
+  acquire(&log.lock);
+  s = findslot(log.seq, b->blockno);
+  if (log.alldata > log.durable || freedrecently(b->blockno) ||
+      (s->seq == log.seq && s->i < LOGMAX)) {
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  if (s->seq != log.seq) {
+    s->blockno = b->blockno;
+    s->seq = log.seq;
+    s->i = LOGMAX + log.ndata;
+    log.data[log.ndata++] = b->blockno;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
+
+// Remember that transaction seq freed blockno.
+// Caller holds log.lock.
+static void addfreed(uint blockno, uint seq) {
+  int i;
+
+  for (i = blockno % NFREED; freed[i].blockno != 0; i = (i + 1) % NFREED)
+    if (freed[i].blockno == blockno)
+      break;
+  if (freed[i].blockno == 0)
+    nfreed++;
+  freed[i].blockno = blockno;
+  freed[i].seq = seq;
+}
+
+// The caller's transaction frees blockno. Until that transaction is
+// durable, a crash would leave the block with its old owner, so
+// new data must not be written over it in place.
+void log_free(uint blockno) {
+  int i;
+
+  if (!log.ordered)
+    return;
+  acquire(&log.lock);
+  if (nfreed >= NFREED / 2) {
+    // drop the stale entries.
+    memmove(oldfreed, freed, sizeof(freed));
+    memset(freed, 0, sizeof(freed));
+    nfreed = 0;
+    for (i = 0; i < NFREED; i++)
+      if (oldfreed[i].blockno != 0 && oldfreed[i].seq > log.durable)
+        addfreed(oldfreed[i].blockno, oldfreed[i].seq);
+  }
+  if (nfreed >= NFREED / 2)
+    log.alldata = log.seq; // too many to track: log all data for now
+  else
+    addfreed(blockno, log.seq);
+  release(&log.lock);
+}
@@ -2,6 +2,7 @@
 #include <xv6/bio.h>
 #include <xv6/console.h>
 #include <xv6/file.h>
+#include <xv6/fpu.h>
 #include <xv6/ide.h>
 #include <xv6/kalloc.h>
 #include <xv6/mb2.h>
@@ -33,6 +34,7 @@ void main(void) {
   kvmalloc();    // kernel page table
   lapicinit();   // interrupt controller
   seginit();     // segment descriptors
+  fpuinit();     // FPU/SIMD state
   picinit();     // disable pic
   ioapicinit();  // another interrupt controller
   consoleinit(); // console hardware
@@ -52,6 +54,7 @@ void main(void) {
 static void mpenter(void) {
   switchkvm();
   seginit();
+  fpuinit();
   lapicinit();
   mpmain();
 }
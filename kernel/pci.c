@@ -0,0 +1,156 @@
+// PCI configuration space access, through configuration
+// mechanism #1 (I/O ports 0xcf8 and 0xcfc).
+
+#include <xv6/memlayout.h>
+#include <xv6/pci.h>
+#include <xv6/types.h>
+#include <xv6/vm.h>
+#include <xv6/x86.h>
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+static uint pciconfread(uint bus, uint dev, uint func, uint off) {
+  outl(PCI_CONFIG_ADDR,
+       0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (off & 0xfc));
+  return inl(PCI_CONFIG_DATA);
+}
+
+uint pciread(struct pcidev *pd, uint off) {
+  return pciconfread(pd->bus, pd->dev, pd->func, off);
+}
+
+void pciwrite(struct pcidev *pd, uint off, uint val) {
+  outl(PCI_CONFIG_ADDR, 0x80000000 | (pd->bus << 16) | (pd->dev << 11) |
+                            (pd->func << 8) | (off & 0xfc));
+  outl(PCI_CONFIG_DATA, val);
+}
+
+// Find the first function whose id and class registers match
+// want under mask, by brute-force scan of all buses.
+// Returns 0 if none.
+static int pcifind(uint idwant, uint idmask, uint clwant, uint clmask,
+                   struct pcidev *pd) {
+  uint bus, dev, func, id, cl, nfunc;
+
+  for (bus = 0; bus < 256; bus++) {
+    for (dev = 0; dev < 32; dev++) {
+      nfunc = 1;
+      for (func = 0; func < nfunc; func++) {
+        id = pciconfread(bus, dev, func, PCI_ID);
+        if ((id & 0xffff) == 0xffff)
+          continue;
+        if (func == 0 && (pciconfread(bus, dev, 0, PCI_HEADER) & 0x800000))
+          nfunc = 8; // multi-function device
+        cl = pciconfread(bus, dev, func, PCI_CLASS);
+        if ((id & idmask) != idwant || (cl & clmask) != clwant)
+          continue;
+        pd->bus = bus;
+        pd->dev = dev;
+        pd->func = func;
+        pd->vendor = id & 0xffff;
+        pd->device = id >> 16;
+        pd->class = cl >> 24;
+        pd->subclass = (cl >> 16) & 0xff;
+        pd->progif = (cl >> 8) & 0xff;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Find the first function of the given class and subclass.
+int pcifindclass(uint class, uint subclass, struct pcidev *pd) {
+  return pcifind(0, 0, (class << 24) | (subclass << 16), 0xffff0000, pd);
+}
+
+// Find the first function with the given vendor and device id.
+int pcifindid(uint vendor, uint device, struct pcidev *pd) {
+  return pcifind((device << 16) | vendor, 0xffffffff, 0, 0, pd);
+}
+
+// Base address of BAR n, with the flag bits masked off.
+// A 64-bit memory BAR takes its high half from BAR n+1.
+ulong pcibar(struct pcidev *pd, int n) {
+  uint lo = pciread(pd, PCI_BAR0 + 4 * n);
+
+  if (lo & 1) // I/O space
+    return lo & ~0x3;
+  if (((lo >> 1) & 3) == 2) // 64-bit memory
+    return (lo & ~0xf) | ((ulong)pciread(pd, PCI_BAR0 + 4 * (n + 1)) << 32);
+  return lo & ~0xf;
+}
+
+// Offset of capability id in configuration space, or 0.
+uint pcifindcap(struct pcidev *pd, uint id) {
+  uint off, cap;
+
+  if (!((pciread(pd, PCI_CMD) >> 16) & 0x10)) // no capability list
+    return 0;
+  for (off = pciread(pd, PCI_CAP) & 0xfc; off; off = (cap >> 8) & 0xfc) {
+    cap = pciread(pd, off);
+    if ((cap & 0xff) == id)
+      return off;
+  }
+  return 0;
+}
+
+// Message address and data that deliver vector to the local APIC
+// with the given id: fixed delivery, edge-triggered.
+#define MSI_ADDR(apicid) (0xfee00000 | ((apicid) << 12))
+
+// Have the device signal vector on cpu apicid with MSI
+// instead of INTx. Returns 0 if the device has no MSI.
+int pcimsienable(struct pcidev *pd, int vector, int apicid) {
+  uint off, ctl;
+
+  if ((off = pcifindcap(pd, PCI_CAP_MSI)) == 0)
+    return 0;
+  ctl = pciread(pd, off) >> 16;
+  pciwrite(pd, off + 4, MSI_ADDR(apicid));
+  if (ctl & 0x80) { // 64-bit address
+    pciwrite(pd, off + 8, 0);
+    pciwrite(pd, off + 12, vector);
+  } else {
+    pciwrite(pd, off + 8, vector);
+  }
+  ctl = (ctl & ~0x70) | 1; // one message, enabled
+  pciwrite(pd, off, (pciread(pd, off) & 0xffff) | (ctl << 16));
+  pciwrite(pd, PCI_CMD, (pciread(pd, PCI_CMD) & 0xffff) | PCI_CMD_INTXOFF);
+  return 1;
+}
+
+// Map the device's MSI-X table, with every vector masked, and
+// switch the device from INTx to MSI-X. Route vectors with
+// pcimsixroute. Returns the table, and its size in *nvec,
+// or 0 if the device has no MSI-X.
+volatile uint *pcimsixenable(struct pcidev *pd, int *nvec) {
+  volatile uint *table;
+  uint off, ctl, tbl;
+  ulong pa;
+  int i;
+
+  if ((off = pcifindcap(pd, PCI_CAP_MSIX)) == 0)
+    return 0;
+  ctl = pciread(pd, off) >> 16;
+  tbl = pciread(pd, off + 4);
+  *nvec = (ctl & 0x7ff) + 1;
+  pa = pcibar(pd, tbl & 7) + (tbl & ~7);
+  kmapdev(pa, *nvec * 16);
+  table = (volatile uint *)P2V(pa);
+  for (i = 0; i < *nvec; i++)
+    table[4 * i + 3] = 1; // masked
+  ctl |= 0x8000; // enable
+  pciwrite(pd, off, (pciread(pd, off) & 0xffff) | (ctl << 16));
+  pciwrite(pd, PCI_CMD, (pciread(pd, PCI_CMD) & 0xffff) | PCI_CMD_INTXOFF);
+  return table;
+}
+
+// Deliver MSI-X table entry to vector on cpu apicid, and unmask it.
+void pcimsixroute(volatile uint *table, int entry, int vector, int apicid) {
+  table[4 * entry + 0] = MSI_ADDR(apicid);
+  table[4 * entry + 1] = 0;
+  table[4 * entry + 2] = vector;
+  table[4 * entry + 3] = 0;
+}
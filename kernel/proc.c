@@ -1,5 +1,6 @@
 #include <xv6/apic.h>
 #include <xv6/console.h>
+#include <xv6/fpu.h>
 #include <xv6/fs.h>
 #include <xv6/kalloc.h>
 #include <xv6/log.h>
@@ -80,6 +81,10 @@ static struct proc *allocproc(void) {
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->fpu = 0;
+  p->fpucpu = -1;
+  p->fsbase = 0;
+  p->gsbase = 0;
 
   release(&ptable.lock);
 
@@ -121,9 +126,7 @@ void userinit(void) {
   p->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
-  p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
-  p->tf->es = p->tf->ds;
-  p->tf->ss = p->tf->ds;
+  p->tf->ss = (SEG_UDATA << 3) | DPL_USER;
   p->tf->rflags = FL_IF;
   p->tf->rsp = PGSIZE;
   p->tf->rip = 0; // beginning of initcode.S
@@ -142,6 +145,24 @@ void userinit(void) {
   release(&ptable.lock);
 }
 
+// Start a kernel thread running fn, which must never return.
+// It has no user memory and never leaves the kernel.
+void kthreadcreate(void (*fn)(void), const char *name) {
+  struct proc *p;
+
+  if ((p = allocproc()) == 0)
+    panic("kthreadcreate: no proc");
+  if ((p->pml4 = setupkvm()) == 0)
+    panic("kthreadcreate: out of memory");
+  // forkret "returns" to fn instead of trapret (see allocproc).
+  *(ulong *)(p->context + 1) = (ulong)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
@@ -181,9 +202,20 @@ int fork(void) {
     np->state = UNUSED;
     return -1;
   }
+  if (fpucopy(np, curproc) < 0) {
+    freevm(np->pml4);
+    np->pml4 = 0;
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   np->sz = curproc->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
+  saveuvm(curproc);
+  np->fsbase = curproc->fsbase;
+  np->gsbase = curproc->gsbase;
 
   // Clear %rax so that fork returns 0 in the child.
   np->tf->rax = 0;
@@ -271,6 +303,7 @@ int wait(void) {
         kfree(p->kstack);
         p->kstack = 0;
         freevm(p->pml4);
+        fpufree(p);
         p->pid = 0;
         p->parent = 0;
         p->name[0] = 0;
@@ -319,9 +352,12 @@ void scheduler(void) {
       // before jumping back to us.
       c->proc = p;
       switchuvm(p);
+      fpuswitchin(p);
       p->state = RUNNING;
 
       swtch(&(c->scheduler), p->context);
+      fpuswitchout(p);
+      saveuvm(p);
       switchkvm();
 
       // Process is done running for now.
@@ -4,37 +4,73 @@
 #include <xv6/sleeplock.h>
 #include <xv6/spinlock.h>
 #include <xv6/types.h>
+#include <xv6/x86.h>
+
+// How long acquiresleep spins on a lock whose owner is running
+// before giving up and sleeping. Roughly the cost of a sleep/wakeup
+// round trip; longer than that and blocking is cheaper.
+#define SLEEPSPIN 20000 // TSC cycles
 
 void initsleeplock(struct sleeplock *lk, const char *name) {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->owner = 0;
+  lk->nwaiters = 0;
   lk->pid = 0;
 }
 
+// Wait, without holding lk->lk, while the lock is held by a process
+// that is running on another cpu and so is likely to release it soon.
+// Owner state is read without ptable.lock; it is only a hint.
+static void spinsleep(struct sleeplock *lk, struct proc *owner) {
+  volatile struct sleeplock *vlk = lk;
+  ulong t0;
+
+  t0 = rdtsc();
+  while (vlk->locked && vlk->owner == owner &&
+         *(volatile enum procstate *)&owner->state == RUNNING &&
+         rdtsc() - t0 < SLEEPSPIN)
+    pause();
+}
+
 void acquiresleep(struct sleeplock *lk) {
+  struct proc *p = myproc();
+  struct proc *owner;
+  int spun = 0;
+
   acquire(&lk->lk);
   while (lk->locked) {
+    owner = lk->owner;
+    if (!spun && owner && owner != p && owner->state == RUNNING) {
+      spun = 1;
+      release(&lk->lk);
+      spinsleep(lk, owner);
+      acquire(&lk->lk);
+      continue;
+    }
+    lk->nwaiters++;
     sleep(lk, &lk->lk);
+    lk->nwaiters--;
   }
   lk->locked = 1;
-  lk->pid = myproc()->pid;
+  lk->owner = p;
+  lk->pid = p->pid;
   release(&lk->lk);
 }
 
 void releasesleep(struct sleeplock *lk) {
   acquire(&lk->lk);
   lk->locked = 0;
+  lk->owner = 0;
   lk->pid = 0;
-  wakeup(lk);
+  if (lk->nwaiters)
+    wakeup(lk);
   release(&lk->lk);
 }
 
+// Only the owner can make this true or false for itself,
+// so no lock is needed to ask.
 int holdingsleep(struct sleeplock *lk) {
-  int r;
-
-  acquire(&lk->lk);
-  r = lk->locked && (lk->pid == myproc()->pid);
-  release(&lk->lk);
-  return r;
+  return lk->locked && lk->owner == myproc();
 }
@@ -2,15 +2,52 @@
 
 #include <xv6/console.h>
 #include <xv6/memlayout.h>
+#include <xv6/param.h>
 #include <xv6/proc.h>
 #include <xv6/spinlock.h>
+#include <xv6/string.h>
 #include <xv6/types.h>
 #include <xv6/x86.h>
 
+#define NLOCKSTAT 32 // distinct lock names tracked; slot 0 catches the rest
+
+// Contention statistics, kept per cpu so that counting does not
+// itself bounce a cache line between cpus. Locks that share a name
+// (every pipe, every sleep lock) share a slot. Only the cpu that
+// owns a row writes it, with interrupts off.
+struct lockstat {
+  uint nacquire;   // acquisitions
+  uint ncontended; // acquisitions that had to wait
+  ulong spincycles; // TSC cycles spent waiting
+};
+
+static const char *statname[NLOCKSTAT] = {"(other)"};
+static struct lockstat lockstats[NCPU][NLOCKSTAT];
+
+// Find or claim the statistics slot for name.
+// initlock can run on several cpus at once, so slots are
+// claimed with a compare-and-swap rather than under a lock.
+static int lockstatslot(const char *name) {
+  const char *n;
+  int i;
+
+  for (i = 1; i < NLOCKSTAT; i++) {
+    n = statname[i];
+    if (n == 0 &&
+        (n = __sync_val_compare_and_swap(&statname[i], 0, name)) == 0)
+      return i;
+    if (n == name || strncmp(n, name, 32) == 0)
+      return i;
+  }
+  return 0;
+}
+
 void initlock(struct spinlock *lk, const char *name) {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->stat = lockstatslot(name);
 }
 
 // Acquire the lock.
@@ -18,13 +55,27 @@ void initlock(struct spinlock *lk, const char *name) {
 // Holding a lock for a long time may cause
 // other CPUs to waste time spinning to acquire it.
 void acquire(struct spinlock *lk) {
+  struct lockstat *st;
+  uint ticket;
+  ulong t0;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if (holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while (xchg(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket and wait for our turn. The locked xadd orders
+  // it; the wait only reads, so waiters share the line rather
+  // than fighting over it.
+  st = &lockstats[mycpu() - cpus][lk->stat];
+  ticket = xadd(&lk->next, 1);
+  if (*(volatile uint *)&lk->owner != ticket) {
+    t0 = rdtsc();
+    while (*(volatile uint *)&lk->owner != ticket)
+      pause();
+    st->ncontended++;
+    st->spincycles += rdtsc() - t0;
+  }
+  st->nacquire++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -51,10 +102,10 @@ void release(struct spinlock *lk) {
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m"(lk->locked) :);
+  // Hand the lock to the next ticket. Only the holder writes
+  // owner, so a plain increment is enough; the asm keeps it a
+  // single store the compiler can't split or move.
+  asm volatile("incl %0" : "+m"(lk->owner) :);
 
   popcli();
 }
@@ -81,7 +132,7 @@ void getcallerpcs(ulong pcs[]) {
 int holding(struct spinlock *lock) {
   int r;
   pushcli();
-  r = lock->locked && lock->cpu == mycpu();
+  r = lock->next != lock->owner && lock->cpu == mycpu();
   popcli();
   return r;
 }
@@ -108,3 +159,35 @@ void popcli(void) {
   if (mycpu()->ncli == 0 && mycpu()->intena)
     sti();
 }
+
+// Print the most contended locks to console. For debugging.
+// Runs when user types ^L on console.
+// No lock, so the numbers may be slightly stale.
+void lockdump(void) {
+  struct lockstat sum[NLOCKSTAT], t;
+  int order[NLOCKSTAT];
+  int c, i, j, k, n;
+
+  memset(sum, 0, sizeof(sum));
+  for (n = 0; n < NLOCKSTAT && statname[n]; n++) {
+    for (c = 0; c < ncpu; c++) {
+      sum[n].nacquire += lockstats[c][n].nacquire;
+      sum[n].ncontended += lockstats[c][n].ncontended;
+      sum[n].spincycles += lockstats[c][n].spincycles;
+    }
+    // insertion sort, most contended first
+    for (j = n; j > 0 && sum[order[j - 1]].ncontended < sum[n].ncontended; j--)
+      order[j] = order[j - 1];
+    order[j] = n;
+  }
+
+  for (i = 0; i < n && i < 10; i++) {
+    k = order[i];
+    t = sum[k];
+    if (t.nacquire == 0)
+      continue;
+    cprintf("%s: %d acquired, %d contended, %d cycles/wait\n", statname[k],
+            t.nacquire, t.ncontended,
+            t.ncontended ? (int)(t.spincycles / t.ncontended) : 0);
+  }
+}
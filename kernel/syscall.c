@@ -121,6 +121,9 @@ extern ulong sys_unlink(void);
 extern ulong sys_wait(void);
 extern ulong sys_write(void);
 extern ulong sys_uptime(void);
+extern ulong sys_arch_prctl(void);
+extern ulong sys_fsync(void);
+extern ulong sys_sync(void);
 
 static ulong (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,     [SYS_exit] = sys_exit,
@@ -133,7 +136,8 @@ static ulong (*syscalls[])(void) = {
     [SYS_open] = sys_open,     [SYS_write] = sys_write,
     [SYS_mknod] = sys_mknod,   [SYS_unlink] = sys_unlink,
     [SYS_link] = sys_link,     [SYS_mkdir] = sys_mkdir,
-    [SYS_close] = sys_close,
+    [SYS_close] = sys_close,   [SYS_arch_prctl] = sys_arch_prctl,
+    [SYS_fsync] = sys_fsync,   [SYS_sync] = sys_sync,
 };
 
 void syscall(void) {
@@ -102,6 +102,22 @@ ulong sys_fstat(void) {
   return filestat(f, st);
 }
 
+// Make fd's file durable. There is one log, so
+// this commits everything that has been written.
+ulong sys_fsync(void) {
+  struct file *f;
+
+  if (argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+ulong sys_sync(void) {
+  log_sync();
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 ulong sys_link(void) {
   char name[DIRSIZ], *new, *old;
@@ -304,6 +320,7 @@ ulong sys_open(void) {
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
+  f->ra.next = f->ra.win = f->ra.end = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
   return fd;
@@ -1,7 +1,9 @@
+#include <xv6/prctl.h>
 #include <xv6/proc.h>
 #include <xv6/syscall.h>
 #include <xv6/trap.h>
 #include <xv6/types.h>
+#include <xv6/vm.h>
 
 ulong sys_fork(void) { return fork(); }
 
@@ -63,3 +65,28 @@ ulong sys_uptime(void) {
   release(&tickslock);
   return xticks;
 }
+
+// Get or set the FS base, which user code uses as its TLS pointer.
+ulong sys_arch_prctl(void) {
+  int code;
+  ulong addr;
+  char *p;
+  struct proc *curproc = myproc();
+
+  if (argint(0, &code) < 0)
+    return -1;
+  switch (code) {
+    case ARCH_SET_FS:
+      if (arglong(1, &addr) < 0 || addr >= curproc->sz)
+        return -1;
+      setfsbase(addr);
+      return 0;
+    case ARCH_GET_FS:
+      if (argptr(1, &p, sizeof(ulong)) < 0)
+        return -1;
+      saveuvm(curproc);
+      *(ulong *)p = curproc->fsbase;
+      return 0;
+  }
+  return -1;
+}
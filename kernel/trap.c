@@ -1,5 +1,6 @@
 #include <xv6/apic.h>
 #include <xv6/console.h>
+#include <xv6/fpu.h>
 #include <xv6/ide.h>
 #include <xv6/kbd.h>
 #include <xv6/proc.h>
@@ -69,6 +70,12 @@ void trap(struct trapframe *tf) {
       cprintf("cpu%d: spurious interrupt at %x:%x\n", cpuid(), tf->cs, tf->rip);
       lapiceoi();
       break;
+    case T_DEVICE:
+      if (myproc() && (tf->cs & 3) == DPL_USER) {
+        fputrap();
+        break;
+      }
+      // FPU use in the kernel is a bug; fall through.
 
     default:
       if (myproc() == 0 || (tf->cs & 3) == 0) {
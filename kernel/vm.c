@@ -9,13 +9,16 @@
 #include <xv6/string.h>
 #include <xv6/types.h>
 #include <xv6/vm.h>
+#include <xv6/x86.h>
 
 pte_t *kpml4;
+static int fsgsbase; // CPU has RDFSBASE/WRFSBASE
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void seginit(void) {
   struct cpu *c;
+  uint a, b, cx, d;
 
   // Map "logical" addresses to virtual addresses using identity map.
   // Cannot share a CODE descriptor for both kernel and user
@@ -44,6 +47,24 @@ void seginit(void) {
                ::"i"((ulong)(SEG_KCODE << 3)),
                "i"(SEG_KDATA << 3)
                : "rax");
+
+  // Let the kernel (and user code) move the FS base without
+  // a trip through wrmsr.
+  readcpuid(0, 0, &a, &b, &cx, &d);
+  if (a >= 7) {
+    readcpuid(7, 0, &a, &b, &cx, &d);
+    if (b & CPUID7_EBX_FSGSBASE) {
+      lcr4(rcr4() | CR4_FSGSBASE);
+      fsgsbase = 1;
+    }
+  }
+}
+
+static void loadfsbase(ulong base) {
+  if (fsgsbase)
+    wrfsbase(base);
+  else
+    wrmsr(MSR_FS_BASE, base);
 }
 
 static pte_t *get_pml1(pte_t *pml2, ulong va, int alloc) {
@@ -149,6 +170,32 @@ void kvmalloc(void) {
   switchkvm();
 }
 
+// Map device registers at physical [pa, pa+size) into the kernel
+// address space, uncached, at P2V(pa). Pages that are already mapped
+// are left alone. Must be called before userinit, since process page
+// tables pick up kernel mappings from kmap when they are created.
+void kmapdev(ulong pa, ulong size) {
+  ulong perm = PTE_W | PTE_PWT | PTE_PCD | PTE_XD;
+  ulong a, end, start = 0;
+  pte_t *pte;
+
+  end = PGROUNDUP(pa + size);
+  for (a = PGROUNDDOWN(pa); a <= end; a += PGSIZE) {
+    if (a < end &&
+        ((pte = walkpml4(kpml4, P2V(a), 0)) == 0 || !(*pte & PTE_P))) {
+      if (start == 0)
+        start = a; // an unmapped run begins
+      continue;
+    }
+    if (start) {
+      kmap_add(start, a, perm, 0);
+      if (mappages(kpml4, P2V(start), a - start, start, perm) < 0)
+        panic("kmapdev");
+      start = 0;
+    }
+  }
+}
+
 // Switch h/w page table register to the kernel-only page table,
 // for when no process is running.
 void switchkvm(void) {
@@ -174,6 +221,27 @@ void switchuvm(struct proc *p) {
   mycpu()->ts.iopb = 0xFFFFFFFFU;
   ltr(SEG_TSS << 3);
   lcr3((ulong)V2P(p->pml4)); // switch to process's address space
+  loadfsbase(p->fsbase);
+  if (fsgsbase)
+    wrgsbase(p->gsbase); // else user code can't change it
+  popcli();
+}
+
+// Copy back per-process CPU state that user code can change
+// without entering the kernel. With FSGSBASE enabled, that is
+// the FS and GS bases (WRFSBASE and WRGSBASE work in user mode).
+void saveuvm(struct proc *p) {
+  if (fsgsbase) {
+    p->fsbase = rdfsbase();
+    p->gsbase = rdgsbase();
+  }
+}
+
+// Set the current process's FS base.
+void setfsbase(ulong base) {
+  pushcli();
+  myproc()->fsbase = base;
+  loadfsbase(base);
   popcli();
 }
 
@@ -21,19 +21,22 @@
 #endif
 
 #define NINODES 200
+#define FSSIZE  2000 // default size of file system in blocks
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE / (BSIZE * 8) + 1;
+uint fssize = FSSIZE;
+int nbitmap;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;    // Number of log blocks, header included
 int nmeta;   // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks; // Number of data blocks
+int ordered; // Set FS_ORDERED
+int delayed; // Set FS_DELAYED
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -64,8 +67,29 @@ uint xint(uint x) {
   return y;
 }
 
+// Parse a size for -s: blocks, or bytes with a K, M or G suffix.
+uint parsesize(char *s) {
+  char *end;
+  unsigned long long n;
+
+  n = strtoull(s, &end, 0);
+  if (*end == 'K' || *end == 'k')
+    n = (n << 10) / BSIZE;
+  else if (*end == 'M' || *end == 'm')
+    n = (n << 20) / BSIZE;
+  else if (*end == 'G' || *end == 'g')
+    n = (n << 30) / BSIZE;
+  else if (*end != 0)
+    n = 0;
+  if ((*end != 0 && end[1] != 0) || n == 0 || n > 0xffffffffULL) {
+    fprintf(stderr, "mkfs: bad size %s\n", s);
+    exit(1);
+  }
+  return n;
+}
+
 int main(int argc, char *argv[]) {
-  int i, cc, fd;
+  int i, cc, fd, maxlog;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
@@ -73,8 +97,46 @@ int main(int argc, char *argv[]) {
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while (argc > 2 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "-d") == 0) {
+      if (argv[1][1] == 'o')
+        ordered = 1;
+      else
+        delayed = 1;
+      argc--;
+      argv++;
+      continue;
+    }
+    if (strcmp(argv[1], "-s") == 0)
+      fssize = parsesize(argv[2]);
+    else if (strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc < 2 || argv[1][0] == '-') {
+    fprintf(stderr, "Usage: mkfs [-s blocks|bytes{K,M,G}] [-l logblocks] [-o] [-d] "
+                    "fs.img files...\n");
+    exit(1);
+  }
+
+  // The header must fit in 2 blocks (then it holds at most LOGMAX
+  // blocks), and the kernel uses at most LOGBLOCKS.
+  maxlog = LOGBLOCKS + 2;
+  while (LOGHEAD(maxlog) > 2 || maxlog - LOGHEAD(maxlog) > LOGBLOCKS)
+    maxlog--;
+
+  // By default the log gets a 16th of the disk, as much as fits.
+  if (nlog == 0) {
+    nlog = fssize / 16;
+    if (nlog < LOGSIZE)
+      nlog = LOGSIZE;
+    if (nlog > maxlog)
+      nlog = maxlog;
+  } else if (nlog < LOGSIZE || nlog > maxlog) {
+    fprintf(stderr, "mkfs: log must have %d to %d blocks\n", LOGSIZE, maxlog);
     exit(1);
   }
 
@@ -87,26 +149,35 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
+  nbitmap = fssize / BPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if (fssize <= nmeta) {
+    fprintf(stderr, "mkfs: %u blocks is too small\n", fssize);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2 + nlog);
   sb.bmapstart = xint(2 + nlog + ninodeblocks);
+  sb.bsize = xint(BSIZE);
+  sb.flags = xint((ordered ? FS_ORDERED : 0) | (delayed ? FS_DELAYED : 0));
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks "
          "%u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta; // the first free block that we can allocate
 
-  for (i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // Zero the whole image; on most file systems this makes it sparse.
+  if (ftruncate(fsfd, (off_t)fssize * BSIZE) < 0) {
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -166,7 +237,7 @@ int main(int argc, char *argv[]) {
 }
 
 void wsect(uint sec, void *buf) {
-  if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
+  if (lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE) {
     perror("lseek");
     exit(1);
   }
@@ -200,7 +271,7 @@ void rinode(uint inum, struct dinode *ip) {
 }
 
 void rsect(uint sec, void *buf) {
-  if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
+  if (lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE) {
     perror("lseek");
     exit(1);
   }
@@ -224,26 +295,62 @@ uint ialloc(ushort type) {
 
 void balloc(int used) {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE * 8);
-  bzero(buf, BSIZE);
-  for (i = 0; i < used; i++) {
-    buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+  assert(used < fssize);
+  for (b = 0; b < used; b += BPB) {
+    bzero(buf, BSIZE);
+    for (i = 0; i < BPB && b + i < used; i++) {
+      buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b / BPB);
+    wsect(sb.bmapstart + b / BPB, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of din, allocating
+// it and the indirect blocks above it as needed.
+uint bmap(struct dinode *din, uint fbn) {
+  uint indirect[NINDIRECT];
+  uint x, i;
+  unsigned long n;
+  int level;
+
+  if (fbn < NDIRECT) {
+    if (xint(din->addrs[fbn]) == 0)
+      din->addrs[fbn] = xint(freeblock++);
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+  for (level = 1, n = NINDIRECT; fbn >= n; level++, n *= NINDIRECT)
+    fbn -= n;
+  assert(level <= NLEVEL);
+
+  if (xint(din->addrs[NDIRECT + level - 1]) == 0)
+    din->addrs[NDIRECT + level - 1] = xint(freeblock++);
+  x = xint(din->addrs[NDIRECT + level - 1]);
+  for (; level > 0; level--) {
+    n /= NINDIRECT;
+    i = fbn / n;
+    rsect(x, (char *)indirect);
+    if (indirect[i] == 0) {
+      indirect[i] = xint(freeblock++);
+      wsect(x, (char *)indirect);
+    }
+    x = xint(indirect[i]);
+    fbn %= n;
+  }
+  return x;
+}
+
 void iappend(uint inum, void *xp, int n) {
   char *p = (char *)xp;
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -251,23 +358,7 @@ void iappend(uint inum, void *xp, int n) {
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while (n > 0) {
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if (fbn < NDIRECT) {
-      if (xint(din.addrs[fbn]) == 0) {
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if (xint(din.addrs[NDIRECT]) == 0) {
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      if (indirect[fbn - NDIRECT] == 0) {
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      }
-      x = xint(indirect[fbn - NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -0,0 +1,91 @@
+// Measure file system throughput under concurrent load.
+//
+// usage: createbench [nproc [nfile]]
+//
+// Each of nproc processes creates nfile files, writes a block to
+// each, and then unlinks them all, so many FS operations are in
+// flight at once and each one has blocks to log. Reports the
+// elapsed timer ticks and the operations done per 100 ticks. The
+// timer is not calibrated, so compare runs on the same machine.
+// nproc * nfile must stay below the free inodes (mkfs makes 200).
+
+#include <xv6/fcntl.h>
+#include <xv6/fs.h>
+#include <xv6/types.h>
+#include <xv6/user.h>
+
+static char buf[BSIZE];
+
+static void name(char *s, int p, int i) {
+  s[0] = 'c';
+  s[1] = 'b';
+  s[2] = '0' + p / 10;
+  s[3] = '0' + p % 10;
+  s[4] = '0' + i / 100;
+  s[5] = '0' + (i / 10) % 10;
+  s[6] = '0' + i % 10;
+  s[7] = '\0';
+}
+
+static void work(int p, int nfile) {
+  char file[8];
+  int i, fd;
+
+  for (i = 0; i < nfile; i++) {
+    name(file, p, i);
+    if ((fd = open(file, O_CREATE | O_RDWR)) < 0) {
+      printf(1, "createbench: create %s failed\n", file);
+      exit();
+    }
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      printf(1, "createbench: write %s failed\n", file);
+      exit();
+    }
+    close(fd);
+  }
+  for (i = 0; i < nfile; i++) {
+    name(file, p, i);
+    if (unlink(file) < 0) {
+      printf(1, "createbench: unlink %s failed\n", file);
+      exit();
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int nproc = 4, nfile = 25;
+  int p, t0, t;
+
+  if (argc > 1)
+    nproc = atoi(argv[1]);
+  if (argc > 2)
+    nfile = atoi(argv[2]);
+  if (nproc < 1 || nproc > 99 || nfile < 1 || nfile > 999) {
+    printf(2, "usage: createbench [nproc (1-99) [nfile (1-999)]]\n");
+    exit();
+  }
+
+  memset(buf, 'x', sizeof(buf));
+  t0 = uptime();
+  for (p = 0; p < nproc; p++) {
+    int pid = fork();
+    if (pid < 0) {
+      printf(1, "createbench: fork failed\n");
+      exit();
+    }
+    if (pid == 0) {
+      work(p, nfile);
+      exit();
+    }
+  }
+  for (p = 0; p < nproc; p++)
+    wait();
+  t = uptime() - t0;
+
+  // open, write and unlink each run a transaction.
+  printf(1, "createbench: %d procs x %d files: %d ticks", nproc, nfile, t);
+  if (t > 0)
+    printf(1, ", %d ops per 100 ticks", 300 * nproc * nfile / t);
+  printf(1, "\n");
+  exit();
+}
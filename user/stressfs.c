@@ -1,7 +1,7 @@
-// Demonstrate that moving the "acquire" in iderw after the loop that
+// Demonstrate that moving the "acquire" in idesubmit after the loop that
 // appends to the idequeue results in a race.
 
-// For this to work, you should also add a spin within iderw's
+// For this to work, you should also add a spin within idesubmit's
 // idequeue traversal loop.  Adding the following demonstrated a panic
 // after about 5 runs of stressfs in QEMU on a 2.1GHz CPU:
 //    for (i = 0; i < 40000; i++)
@@ -0,0 +1,70 @@
+// Measure the cost of a round trip through alltraps/trapret.
+//
+// syscall:   getpid() in a loop, each call timed with rdtsc.
+// interrupt: spin reading the time stamp counter; a gap longer
+//            than GAP cycles between two reads is time stolen by an
+//            interrupt (usually the timer) entering and leaving
+//            the kernel.
+//
+// Only the minimum is a fair comparison between kernels; the
+// averages also include cache misses and, for interrupts, the
+// trip through the scheduler that yield() takes.
+//
+// To compare two kernels, boot each on the same host with a single
+// CPU (make q NCPU=1), run trapbench a few times and keep the
+// lowest minimum of each.
+
+#include <xv6/types.h>
+#include <xv6/user.h>
+#include <xv6/x86.h>
+
+#define NSYSCALL 10000
+#define NINTR    100
+#define GAP      500
+
+static void syscallbench(void) {
+  ulong t0, t, min, tot;
+  int i;
+
+  min = ~0UL;
+  tot = 0;
+  for (i = 0; i < NSYSCALL; i++) {
+    t0 = rdtsc();
+    getpid();
+    t = rdtsc() - t0;
+    if (t < min)
+      min = t;
+    tot += t;
+  }
+  printf(1, "syscall:   min %d avg %d cycles (%d calls)\n", (int)min,
+         (int)(tot / NSYSCALL), NSYSCALL);
+}
+
+static void intrbench(void) {
+  ulong prev, now, t, min, tot;
+  int n;
+
+  min = ~0UL;
+  tot = 0;
+  n = 0;
+  prev = rdtsc();
+  while (n < NINTR) {
+    now = rdtsc();
+    t = now - prev;
+    prev = now;
+    if (t < GAP)
+      continue;
+    if (t < min)
+      min = t;
+    tot += t;
+    n++;
+  }
+  printf(1, "interrupt: min %d avg %d cycles (%d interrupts)\n", (int)min,
+         (int)(tot / NINTR), NINTR);
+}
+
+int main(int argc, char *argv[]) {
+  syscallbench();
+  intrbench();
+  exit();
+}
@@ -0,0 +1,45 @@
+// User program entry point.
+// exec() starts a program here with argc in %rdi and argv in %rsi.
+
+#include <xv6/prctl.h>
+#include <xv6/types.h>
+#include <xv6/user.h>
+
+// TLS initialization image, laid out by user.ld.
+extern char __tdata_start[], __tdata_end[], __tbss_end[], __tls_align[];
+
+int main(int argc, char *argv[]);
+
+// Give the process its thread-local storage.
+// x86-64 uses TLS variant II: the FS base (thread pointer) points at
+// a thread control block whose first word points to itself, and the
+// TLS block sits right below it, so variables live at negative
+// offsets from %fs.
+static void tlsinit(void) {
+  ulong filesz = __tdata_end - __tdata_start;
+  ulong memsz = __tbss_end - __tdata_start;
+  ulong align = (ulong)__tls_align;
+  ulong size, *tcb;
+  char *p;
+
+  if (memsz == 0)
+    return;
+  if (align < sizeof(ulong))
+    align = sizeof(ulong);
+  size = (memsz + align - 1) & ~(align - 1);
+  if ((p = sbrk(size + sizeof(ulong) + align)) == (char *)-1)
+    exit();
+
+  tcb = (ulong *)((((ulong)p + size) + align - 1) & ~(align - 1));
+  p = (char *)tcb - size;
+  memmove(p, __tdata_start, filesz);
+  memset(p + filesz, 0, size - filesz);
+  tcb[0] = (ulong)tcb;
+  arch_prctl(ARCH_SET_FS, (ulong)tcb);
+}
+
+void _start(int argc, char *argv[]) {
+  tlsinit();
+  main(argc, argv);
+  exit();
+}
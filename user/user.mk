@@ -9,7 +9,7 @@ UPROGS = $(patsubst user/%, user/_%, $(basename $(UPROG_SRCS)))
 
 .PRECIOUS: $(addsuffix .o, $(basename $(UPROG_SRCS)))
 
-user/_forktest: user/forktest.o user/ulib/ulib.o user/ulib/usys.o
+user/_forktest: user/forktest.o user/ulib/start.o user/ulib/ulib.o user/ulib/usys.o
 # forktest has less library code linked in - needs to be small
 # in order to be able to max out the proc table.
 	$(LD) $(LDFLAGS) -Tuser/user.ld -o $@ $^
@@ -2,6 +2,7 @@
 #include <xv6/fs.h>
 #include <xv6/memlayout.h>
 #include <xv6/param.h>
+#include <xv6/prctl.h>
 #include <xv6/stat.h>
 #include <xv6/systbl.h>
 #include <xv6/traptbl.h>
@@ -174,6 +175,9 @@ void writetest(void) {
   printf(stdout, "small file test ok\n");
 }
 
+// Enough blocks to need the double-indirect block.
+#define NBIG (NDIRECT + NINDIRECT + 8)
+
 void writetest1(void) {
   int i, fd, n;
 
@@ -185,9 +189,9 @@ void writetest1(void) {
     exit();
   }
 
-  for (i = 0; i < MAXFILE; i++) {
+  for (i = 0; i < NBIG; i++) {
     ((int *)buf)[0] = i;
-    if (write(fd, buf, 512) != 512) {
+    if (write(fd, buf, BSIZE) != BSIZE) {
       printf(stdout, "error: write big file failed\n", i);
       exit();
     }
@@ -203,14 +207,14 @@ void writetest1(void) {
 
   n = 0;
   for (;;) {
-    i = read(fd, buf, 512);
+    i = read(fd, buf, BSIZE);
     if (i == 0) {
-      if (n == MAXFILE - 1) {
+      if (n != NBIG) {
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
       break;
-    } else if (i != 512) {
+    } else if (i != BSIZE) {
       printf(stdout, "read failed %d\n", i);
       exit();
     }
@@ -1668,6 +1672,152 @@ void argptest(void) {
   printf(1, "arg test passed\n");
 }
 
+// do FPU/SIMD registers survive context switches and fork?
+void fputest(void) {
+  int i, k, pid;
+  double x;
+
+  printf(1, "fpu test\n");
+
+  for (k = 1; k <= 4; k++) {
+    pid = fork();
+    if (pid < 0) {
+      printf(1, "fork failed\n");
+      exit();
+    }
+    if (pid == 0)
+      break;
+  }
+
+  // Every partial sum is a multiple of 0.25, so it is exact.
+  x = 0;
+  for (i = 0; i < 1000000; i++)
+    x += k * 0.25;
+  if (x != k * 250000.0) {
+    printf(1, "fpu test: process %d got wrong sum\n", k);
+    exit();
+  }
+  if (k <= 4)
+    exit();
+
+  for (k = 1; k <= 4; k++)
+    wait();
+  printf(1, "fpu test ok\n");
+}
+
+__thread int tlsval = 7;
+__thread char tlsbss[100];
+
+// are TLS variables initialized, and is the FS base kept across fork?
+void tlstest(void) {
+  ulong base;
+  int pid;
+
+  printf(1, "tls test\n");
+
+  if (tlsval != 7 || tlsbss[0] != 0 || tlsbss[99] != 0) {
+    printf(1, "tls test: bad initial values\n");
+    exit();
+  }
+  if (arch_prctl(ARCH_GET_FS, (ulong)&base) < 0 || *(ulong *)base != base) {
+    printf(1, "tls test: bad thread pointer\n");
+    exit();
+  }
+  if (arch_prctl(ARCH_SET_FS, ~0UL) >= 0) {
+    printf(1, "tls test: set a bad fs base\n");
+    exit();
+  }
+
+  tlsval = 8;
+  tlsbss[99] = 1;
+  pid = fork();
+  if (pid < 0) {
+    printf(1, "fork failed\n");
+    exit();
+  }
+  if (pid == 0) {
+    if (tlsval != 8 || tlsbss[99] != 1) {
+      printf(1, "tls test: child lost tls\n");
+      exit();
+    }
+    tlsval = 9;
+    exit();
+  }
+  wait();
+  if (tlsval != 8) {
+    printf(1, "tls test: child changed parent tls\n");
+    exit();
+  }
+  printf(1, "tls test ok\n");
+}
+
+// fsync and sync succeed on files, and fsync fails on pipes.
+void synctest(void) {
+  int fd, fds[2];
+
+  printf(1, "sync test\n");
+
+  fd = open("synctest", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf(1, "sync test: create failed\n");
+    exit();
+  }
+  if (write(fd, "abc", 3) != 3 || fsync(fd) != 0) {
+    printf(1, "sync test: fsync failed\n");
+    exit();
+  }
+  close(fd);
+  if (unlink("synctest") < 0 || sync() != 0) {
+    printf(1, "sync test: sync failed\n");
+    exit();
+  }
+  if (pipe(fds) != 0) {
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+  if (fsync(fds[0]) >= 0 || fsync(-1) >= 0) {
+    printf(1, "sync test: fsync of a pipe succeeded\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  printf(1, "sync test ok\n");
+}
+
+// Write a file bigger than the default log, a few blocks per
+// write. On a file system made with mkfs -d, transactions stay open
+// after their ops end, so the log fills with no ops in flight, and
+// the next op must freeze the transaction itself.
+#define NLOGFILL 400
+
+void logfill(void) {
+  int fd, i;
+
+  printf(1, "logfill test\n");
+
+  fd = open("logfill", O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf(1, "logfill: create failed\n");
+    exit();
+  }
+  for (i = 0; i < NLOGFILL; i += 2) {
+    if (write(fd, buf, 2 * BSIZE) != 2 * BSIZE) {
+      printf(1, "logfill: write failed\n");
+      exit();
+    }
+  }
+  if (fsync(fd) != 0) {
+    printf(1, "logfill: fsync failed\n");
+    exit();
+  }
+  close(fd);
+  if (unlink("logfill") < 0) {
+    printf(1, "logfill: unlink failed\n");
+    exit();
+  }
+  printf(1, "logfill test ok\n");
+}
+
 unsigned long randstate = 1;
 unsigned int rand(void) {
   randstate = randstate * 1664525 + 1013904223;
@@ -1684,6 +1834,8 @@ int main(int argc, char *argv[]) {
   close(open("usertests.ran", O_CREATE));
 
   argptest();
+  fputest();
+  tlstest();
   createdelete();
   linkunlink();
   concreate();
@@ -1692,6 +1844,8 @@ int main(int argc, char *argv[]) {
 
   bigargtest();
   bigwrite();
+  synctest();
+  logfill();
   bigargtest();
   bsstest();
   sbrktest();